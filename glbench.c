@@ -0,0 +1,573 @@
+/* gcc -std=c99 -O2 glbench.c -o glbench -lEGL -lasound -lpthread
+ *
+ * Headless benchmark of what glcapture adds to a game's frame time, run with and without it to compare
+ * Renders animated frames to an EGL pbuffer while a second thread plays audio on ALSA's null PCM,
+ * and when glcapture is preloaded reads the rawmux stream from FIFO_PATH and throws it away
+ * Reports eglSwapBuffers percentiles and frame rate, plus glcapture's own per swap overhead, throughput and
+ * drops from its stats page (see rawstats.h), frames of the first second are left out as warm up
+ * Needs no GPU, "make bench" runs it on Mesa's llvmpipe so the numbers are comparable across commits
+ * Usage: EGL_PLATFORM=surfaceless LIBGL_ALWAYS_SOFTWARE=1 [LD_PRELOAD=./glcapture.so] ./glbench [-s 1280x720] [-n 600] [-r 60] [-e] [-q] [-m] [-d null] [-c]
+ *        -s size of the frames, -n frames to render, -r frame rate limit (0 renders as fast as it can),
+ *        -e OpenGL ES instead of desktop OpenGL, -q without the audio thread,
+ *        -m writes the audio with snd_pcm_mmap_begin/commit instead of snd_pcm_writei, -d PCM to play on,
+ *        -c checks the captured audio track sample by sample instead of throwing the stream away, fails if it doesn't match
+ *        e.g. -c -m -d plug:null checks mmap capture through a plugin PCM
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <EGL/egl.h>
+#include <GL/gl.h>
+#include <alsa/asoundlib.h>
+
+#include "rawstats.h"
+
+// Same as glcapture's defaults
+static const char *FIFO_PATH = "/tmp/glcapture.fifo";
+static const char *STATS_PATH = "/tmp/glcapture.stats";
+
+#define AUDIO_RATE 48000
+#define AUDIO_CHANNELS 2
+#define AUDIO_PERIOD_FRAMES 480
+
+// Packet with a new rawmux header as payload (glcapture's RECONFIGURE_PACKETS)
+#define RAWMUX_RECONFIGURE 0xff
+
+struct options {
+   const char *device;
+   uint32_t width, height, frames, fps;
+   bool es, quiet, mmap, check;
+};
+
+// What -c found in the stream so far
+struct check {
+   pthread_mutex_t lock;
+   int audio; // stream id of the audio track, -1 if there's none
+   uint32_t tracks;
+   uint64_t frames, gaps, first, next; // next is the frame number expected next
+};
+
+struct gl {
+   void (*ClearColor)(GLfloat, GLfloat, GLfloat, GLfloat);
+   void (*Clear)(GLbitfield);
+   void (*Scissor)(GLint, GLint, GLsizei, GLsizei);
+   void (*Enable)(GLenum);
+   void (*Disable)(GLenum);
+   const GLubyte* (*GetString)(GLenum);
+};
+
+static bool STOP;
+static uint64_t CONSUMED; // bytes read from the fifo
+static uint64_t PLAYED; // audio frames written
+static struct check CHECK = { .lock = PTHREAD_MUTEX_INITIALIZER, .audio = -1 };
+
+static uint64_t
+now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(const uint64_t ns)
+{
+   const struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static bool
+parse_options(int argc, char *argv[], struct options *options)
+{
+   *options = (struct options){ .device = "null", .width = 1280, .height = 720, .frames = 600, .fps = 60 };
+
+   for (int opt; (opt = getopt(argc, argv, "s:n:r:eqmd:c")) != -1;) {
+      switch (opt) {
+         case 's':
+            if (sscanf(optarg, "%ux%u", &options->width, &options->height) != 2 || !options->width || !options->height)
+               return false;
+            break;
+         case 'n': options->frames = strtoul(optarg, NULL, 10); break;
+         case 'r': options->fps = strtoul(optarg, NULL, 10); break;
+         case 'e': options->es = true; break;
+         case 'q': options->quiet = true; break;
+         case 'm': options->mmap = true; break;
+         case 'd': options->device = optarg; break;
+         case 'c': options->check = true; break;
+         default: return false;
+      }
+   }
+
+   return (optind == argc && options->frames > 0 && !(options->check && options->quiet));
+}
+
+static bool
+read_all(FILE *in, void *data, const size_t size)
+{
+   return fread(data, 1, size, in) == size;
+}
+
+// glcapture names every PCM's track in the header, we only ever play on one
+static bool
+read_header(FILE *in, struct check *check)
+{
+   uint8_t magic[7];
+   if (!read_all(in, magic, sizeof(magic)) || memcmp(magic, "rawmux", 6))
+      return false;
+
+   check->audio = -1;
+   check->tracks = 0;
+
+   for (int stream = 0;; ++stream) {
+      uint8_t type, fields[16];
+      if (!read_all(in, &type, 1))
+         return false;
+
+      if (!type)
+         return true;
+
+      for (int c; (c = fgetc(in));) {
+         if (c == EOF)
+            return false;
+      }
+
+      // Video has offset, size and dimensions, audio the rate and channels
+      if (!read_all(in, fields, (type == 1 ? 16 : 5)))
+         return false;
+
+      if (type == 2) {
+         check->audio = stream;
+         check->tracks++;
+      }
+   }
+}
+
+// Frame numbers have to follow each other without gaps, whatever was played before the reader attached is fine to miss
+static void
+check_audio(struct check *check, const uint8_t *data, const uint32_t size)
+{
+   for (uint32_t i = 0; i + 4 <= size; i += 4) {
+      uint16_t half[2];
+      memcpy(half, data + i, sizeof(half));
+      const uint64_t frame = half[0] | (uint64_t)half[1] << 16;
+
+      if (!check->frames)
+         check->first = frame;
+      else if (frame != check->next)
+         check->gaps++;
+
+      check->next = frame + 1;
+      check->frames++;
+   }
+}
+
+static void
+check_stream(FILE *in)
+{
+   pthread_mutex_lock(&CHECK.lock);
+   const bool header = read_header(in, &CHECK);
+   pthread_mutex_unlock(&CHECK.lock);
+
+   if (!header)
+      errx(EXIT_FAILURE, "check: bad rawmux header");
+
+   uint8_t *data = NULL;
+   size_t allocated = 0;
+
+   for (uint8_t packet[13]; read_all(in, packet, sizeof(packet));) {
+      uint32_t size;
+      memcpy(&size, packet + 1, sizeof(size));
+
+      if (allocated < size && !(data = realloc(data, (allocated = size))))
+         err(EXIT_FAILURE, "realloc");
+
+      if (!read_all(in, data, size))
+         break;
+
+      __atomic_add_fetch(&CONSUMED, sizeof(packet) + size, __ATOMIC_RELAXED);
+      pthread_mutex_lock(&CHECK.lock);
+
+      if (packet[0] == RAWMUX_RECONFIGURE) {
+         FILE *header;
+         if (!(header = fmemopen(data, size, "rb")) || !read_header(header, &CHECK))
+            errx(EXIT_FAILURE, "check: bad reconfigure packet");
+         fclose(header);
+      } else if (packet[0] == CHECK.audio) {
+         check_audio(&CHECK, data, size);
+      }
+
+      pthread_mutex_unlock(&CHECK.lock);
+   }
+
+   free(data);
+}
+
+// Null consumer, splice moves the pages to /dev/null without touching them so the reader costs next to nothing
+static void*
+consume(void *arg)
+{
+   const struct options *options = arg;
+
+   // glcapture creates the fifo on its first swap, main removed any stale one before that
+   int fd;
+   while ((fd = open(FIFO_PATH, O_RDONLY | O_CLOEXEC)) < 0) {
+      if (errno != ENOENT && errno != EINTR)
+         err(EXIT_FAILURE, "open(%s)", FIFO_PATH);
+
+      if (__atomic_load_n(&STOP, __ATOMIC_RELAXED))
+         return NULL;
+
+      sleep_until(now_ns() + 10000000);
+   }
+
+   if (options->check) {
+      FILE *in;
+      if (!(in = fdopen(fd, "rb")))
+         err(EXIT_FAILURE, "fdopen");
+
+      check_stream(in);
+      fclose(in);
+      return NULL;
+   }
+
+   const int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+   static uint8_t buf[1024 * 1024];
+
+   for (ssize_t ret;;) {
+      if ((ret = splice(fd, NULL, null, NULL, sizeof(buf), SPLICE_F_MOVE)) < 0 && errno == EINVAL)
+         ret = read(fd, buf, sizeof(buf));
+
+      if (ret < 0 && errno == EINTR)
+         continue;
+
+      if (ret <= 0)
+         break;
+
+      __atomic_add_fetch(&CONSUMED, ret, __ATOMIC_RELAXED);
+   }
+
+   close(null);
+   close(fd);
+   return NULL;
+}
+
+// Copies interleaved frames to the PCM's own buffer, the way games that mix straight into it do
+static snd_pcm_sframes_t
+write_mmap(snd_pcm_t *pcm, const uint16_t *samples, const snd_pcm_uframes_t frames)
+{
+   snd_pcm_uframes_t done = 0;
+   for (snd_pcm_sframes_t ret; done < frames; done += ret) {
+      const snd_pcm_channel_area_t *areas;
+      snd_pcm_uframes_t offset, count = frames - done;
+
+      if ((ret = snd_pcm_avail_update(pcm)) < 0 || (ret = snd_pcm_mmap_begin(pcm, &areas, &offset, &count)) < 0)
+         return ret;
+
+      for (snd_pcm_uframes_t i = 0; i < count; ++i) {
+         for (uint32_t c = 0; c < AUDIO_CHANNELS; ++c)
+            memcpy((uint8_t*)areas[c].addr + (areas[c].first + (offset + i) * areas[c].step) / 8, &samples[(done + i) * AUDIO_CHANNELS + c], 2);
+      }
+
+      if ((ret = snd_pcm_mmap_commit(pcm, offset, count)) <= 0)
+         return (ret < 0 ? ret : (snd_pcm_sframes_t)done);
+   }
+   return done;
+}
+
+// Plays in real time, the null PCM itself doesn't block
+// Left and right carry the low and high half of the frame number, a sawtooth that -c can check every sample of
+static void*
+play(void *arg)
+{
+   const struct options *options = arg;
+
+   snd_pcm_t *pcm;
+   int ret;
+   const snd_pcm_access_t access = (options->mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED);
+   if ((ret = snd_pcm_open(&pcm, options->device, SND_PCM_STREAM_PLAYBACK, 0)) < 0 ||
+       (ret = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE, access, AUDIO_CHANNELS, AUDIO_RATE, 0, 100000)) < 0) {
+      warnx("%s pcm: %s, running without audio", options->device, snd_strerror(ret));
+      return NULL;
+   }
+
+   uint16_t samples[AUDIO_PERIOD_FRAMES * AUDIO_CHANNELS];
+   uint64_t next = now_ns();
+
+   for (uint64_t frame = 0; !__atomic_load_n(&STOP, __ATOMIC_RELAXED);) {
+      for (size_t i = 0; i < AUDIO_PERIOD_FRAMES; ++i, ++frame) {
+         samples[i * 2] = frame & 0xffff;
+         samples[i * 2 + 1] = (frame >> 16) & 0xffff;
+      }
+
+      if ((options->mmap ? write_mmap(pcm, samples, AUDIO_PERIOD_FRAMES) : snd_pcm_writei(pcm, samples, AUDIO_PERIOD_FRAMES)) < 0)
+         snd_pcm_prepare(pcm);
+
+      __atomic_store_n(&PLAYED, frame, __ATOMIC_RELAXED);
+
+      sleep_until((next += (uint64_t)AUDIO_PERIOD_FRAMES * 1000000000 / AUDIO_RATE));
+   }
+
+   snd_pcm_close(pcm);
+   return NULL;
+}
+
+static void
+load_gl(struct gl *gl)
+{
+#define GL(x) do { if (!(gl->x = (void*)eglGetProcAddress("gl"#x))) errx(EXIT_FAILURE, "no gl"#x); } while (0)
+   GL(ClearColor);
+   GL(Clear);
+   GL(Scissor);
+   GL(Enable);
+   GL(Disable);
+   GL(GetString);
+#undef GL
+}
+
+static EGLDisplay
+setup_egl(const struct options *options)
+{
+   EGLDisplay dpy;
+   if (!(dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY)) || !eglInitialize(dpy, NULL, NULL))
+      errx(EXIT_FAILURE, "no EGL display, try EGL_PLATFORM=surfaceless");
+
+   if (!eglBindAPI(options->es ? EGL_OPENGL_ES_API : EGL_OPENGL_API))
+      errx(EXIT_FAILURE, "eglBindAPI failed");
+
+   const EGLint config_attribs[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+      EGL_RENDERABLE_TYPE, (options->es ? EGL_OPENGL_ES3_BIT : EGL_OPENGL_BIT),
+      EGL_NONE,
+   };
+
+   EGLConfig config;
+   EGLint count;
+   if (!eglChooseConfig(dpy, config_attribs, &config, 1, &count) || !count)
+      errx(EXIT_FAILURE, "no pbuffer config");
+
+   const EGLint surface_attribs[] = { EGL_WIDTH, options->width, EGL_HEIGHT, options->height, EGL_NONE };
+   const EGLint es_attribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_NONE };
+
+   EGLSurface surface;
+   EGLContext context;
+   if (!(surface = eglCreatePbufferSurface(dpy, config, surface_attribs)) ||
+       !(context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, (options->es ? es_attribs : NULL))) ||
+       !eglMakeCurrent(dpy, surface, surface, context))
+      errx(EXIT_FAILURE, "failed to create a %ux%u pbuffer context", options->width, options->height);
+
+   return dpy;
+}
+
+// Background color cycles and a grid of boxes moves around, so no two frames in a row are alike
+static void
+draw(const struct gl *gl, const struct options *options, const uint32_t frame)
+{
+   gl->ClearColor((frame % 120) / 120.0f, 0.25f, 0.5f, 1.0f);
+   gl->Clear(GL_COLOR_BUFFER_BIT);
+   gl->Enable(GL_SCISSOR_TEST);
+
+   const uint32_t box = options->height / 8;
+   for (uint32_t i = 0; i < 16; ++i) {
+      const uint32_t x = (i * 97 + frame * (i + 1) * 3) % options->width, y = (i * 53 + frame * 2) % options->height;
+      gl->Scissor(x, y, box, box);
+      gl->ClearColor((i & 1), (i & 2) / 2.0f, (i & 4) / 4.0f, 1.0f);
+      gl->Clear(GL_COLOR_BUFFER_BIT);
+   }
+
+   gl->Disable(GL_SCISSOR_TEST);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+   const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+   return (x > y) - (x < y);
+}
+
+// Sorts the samples
+static void
+report_times(const char *name, uint64_t *ns, const uint32_t count)
+{
+   qsort(ns, count, sizeof(*ns), compare_u64);
+   printf("%s (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", name, ns[count / 2] / 1e3, ns[count * 90 / 100] / 1e3,
+          ns[count * 99 / 100] / 1e3, ns[count * 999 / 1000] / 1e3, ns[count - 1] / 1e3);
+}
+
+// Stats page of the glcapture preloaded to this process, NULL if there isn't one
+static const struct rawstats*
+open_stats(void)
+{
+   int fd;
+   const struct rawstats *stats;
+   if ((fd = open(STATS_PATH, O_RDONLY | O_CLOEXEC)) < 0)
+      return NULL;
+
+   stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (stats == MAP_FAILED)
+      return NULL;
+
+   if (memcmp(stats->magic, RAWSTATS_MAGIC, sizeof(stats->magic)) || stats->version != RAWSTATS_VERSION || stats->pid != (uint32_t)getpid()) {
+      munmap((void*)stats, sizeof(*stats));
+      return NULL;
+   }
+
+   return stats;
+}
+
+static double
+quantile_us(const uint64_t bucket[RAWSTATS_BUCKETS], const double q, const uint64_t max)
+{
+   const uint64_t ns = rawstats_quantile(bucket, q);
+   return (ns < max ? ns : max) / 1e3;
+}
+
+static void
+report_glcapture(const struct rawstats *now, const struct rawstats *start, const double seconds, const uint64_t consumed)
+{
+   const struct rawstats_histogram *a = &now->stage[RAWSTATS_SWAP], *b = &start->stage[RAWSTATS_SWAP];
+   uint64_t bucket[RAWSTATS_BUCKETS];
+   for (uint32_t i = 0; i < RAWSTATS_BUCKETS; ++i)
+      bucket[i] = a->bucket[i] - b->bucket[i];
+
+   const uint64_t swaps = a->count - b->count;
+   printf("glcapture per swap (us): mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+          (swaps ? (double)(a->sum - b->sum) / swaps / 1e3 : 0), quantile_us(bucket, 0.5, a->max), quantile_us(bucket, 0.9, a->max),
+          quantile_us(bucket, 0.99, a->max), quantile_us(bucket, 0.999, a->max), a->max / 1e3);
+
+#define DIFF(x) (now->counter[x] - start->counter[x])
+   printf("glcapture throughput: %.1f frames/s captured, %.1f MiB/s written, %.1f MiB/s read by the consumer, %.0f audio frames/s\n",
+          DIFF(RAWSTATS_FRAMES) / seconds, DIFF(RAWSTATS_BYTES) / seconds / (1024 * 1024),
+          consumed / seconds / (1024 * 1024), DIFF(RAWSTATS_AUDIO_FRAMES) / seconds);
+   printf("glcapture drops: %llu frames over the rate limit, %llu frames missed (no free pbo), %llu packets dropped (queue full or too big), %llu packets skipped (stale)\n",
+          (unsigned long long)DIFF(RAWSTATS_FRAMES_DROPPED), (unsigned long long)DIFF(RAWSTATS_FRAMES_MISSED),
+          (unsigned long long)DIFF(RAWSTATS_PACKETS_DROPPED), (unsigned long long)DIFF(RAWSTATS_PACKETS_SKIPPED));
+#undef DIFF
+}
+
+// glcapture sends out the last audio once it has been quiet for a bit, give it a moment before looking
+static bool
+report_check(void)
+{
+   sleep_until(now_ns() + 500000000);
+
+   pthread_mutex_lock(&CHECK.lock);
+   const struct check check = CHECK;
+   pthread_mutex_unlock(&CHECK.lock);
+
+   const uint64_t played = __atomic_load_n(&PLAYED, __ATOMIC_RELAXED);
+   const bool ok = (check.tracks == 1 && check.frames && !check.gaps && check.next == played);
+
+   printf("audio check: %u tracks, frames %llu..%llu of the %llu played, %llu gaps: %s\n", check.tracks,
+          (unsigned long long)check.first, (unsigned long long)check.next, (unsigned long long)played,
+          (unsigned long long)check.gaps, (ok ? "ok" : "FAILED"));
+   return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+   struct options options;
+   if (!parse_options(argc, argv, &options)) {
+      fprintf(stderr, "usage: %s [-s 1280x720] [-n 600] [-r 60] [-e] [-q] [-m] [-d null] [-c]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   // Consumer must not attach to a fifo left over from an earlier run
+   remove(FIFO_PATH);
+
+   pthread_t consumer, player;
+   if (pthread_create(&consumer, NULL, consume, &options) || (!options.quiet && pthread_create(&player, NULL, play, &options)))
+      errx(EXIT_FAILURE, "pthread_create failed");
+
+   const EGLDisplay dpy = setup_egl(&options);
+   const EGLSurface surface = eglGetCurrentSurface(EGL_DRAW);
+   struct gl gl;
+   load_gl(&gl);
+
+   char fps[16] = "unlimited";
+   if (options.fps)
+      snprintf(fps, sizeof(fps), "%u", options.fps);
+
+   const uint32_t warmup = (options.fps ? options.fps : 60);
+   printf("glbench: %ux%u %s on %s, %u frames at %s fps (first %u are warm up), audio %s\n", options.width, options.height,
+          (options.es ? "gles" : "gl"), (const char*)gl.GetString(GL_RENDERER), options.frames, fps, warmup,
+          (options.quiet ? "off" : (options.mmap ? "on (mmap)" : "on")));
+
+   // Frame is drawing plus the swap, llvmpipe renders in the background so glcapture's readback may end up waiting for either
+   uint64_t *frame_ns, *swap_ns;
+   if (!(frame_ns = calloc(options.frames, sizeof(*frame_ns))) || !(swap_ns = calloc(options.frames, sizeof(*swap_ns))))
+      err(EXIT_FAILURE, "calloc");
+
+   const struct rawstats *stats = NULL;
+   struct rawstats start = {0};
+   uint64_t started = now_ns(), consumed = 0, deadline = started;
+
+   for (uint32_t i = 0; i < options.frames; ++i) {
+      if (i == warmup) {
+         if ((stats = open_stats()))
+            memcpy(&start, stats, sizeof(start));
+
+         consumed = __atomic_load_n(&CONSUMED, __ATOMIC_RELAXED);
+         started = now_ns();
+      }
+
+      const uint64_t before_draw = now_ns();
+      draw(&gl, &options, i);
+
+      const uint64_t before_swap = now_ns();
+      eglSwapBuffers(dpy, surface);
+      swap_ns[i] = now_ns() - before_swap;
+      frame_ns[i] = now_ns() - before_draw;
+
+      // Late frames don't get to catch up, a game wouldn't either
+      if (options.fps) {
+         deadline += 1000000000 / options.fps;
+         const uint64_t now = now_ns();
+         deadline = (deadline < now ? now : deadline);
+         sleep_until(deadline);
+      }
+   }
+
+   const double seconds = (now_ns() - started) / 1e9;
+   const uint32_t measured = (options.frames > warmup ? options.frames - warmup : 0);
+
+   if (!measured)
+      errx(EXIT_FAILURE, "nothing measured, render more than the %u warm up frames", warmup);
+
+   struct rawstats end;
+   if (stats)
+      memcpy(&end, stats, sizeof(end));
+
+   consumed = __atomic_load_n(&CONSUMED, __ATOMIC_RELAXED) - consumed;
+   __atomic_store_n(&STOP, true, __ATOMIC_RELAXED);
+
+   report_times("frame", frame_ns + warmup, measured);
+   report_times("eglSwapBuffers", swap_ns + warmup, measured);
+   printf("frames: %u in %.2fs (%.1f fps)\n", measured, seconds, measured / seconds);
+
+   if (stats) {
+      report_glcapture(&end, &start, seconds, consumed);
+   } else {
+      printf("glcapture: not preloaded\n");
+   }
+
+   if (!options.quiet)
+      pthread_join(player, NULL);
+
+   // Consumer may still be blocked on the fifo, exiting takes care of it
+   return (options.check && !report_check() ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -1,5 +1,5 @@
-/* gcc -std=c99 -fPIC -shared -Wl,-soname,glcapture.so glcapture.c -lasound -o glcapture.so
- * gcc -m32 -std=c99 -fPIC -shared -Wl,-soname,glcapture.so glcapture.c -lasound -o glcapture.so (for 32bit)
+/* gcc -std=c99 -fPIC -shared -Wl,-soname,glcapture.so glcapture.c -lasound -lpthread -o glcapture.so
+ * gcc -m32 -std=c99 -fPIC -shared -Wl,-soname,glcapture.so glcapture.c -lasound -lpthread -o glcapture.so (for 32bit)
  *
  * Capture OpenGL framebuffer, ALSA audio and push them through named pipe
  * Usage: LD_PRELOAD="/path/to/glcapture.so" ./program
@@ -7,12 +7,24 @@
  * https://github.com/Cloudef/FFmpeg/tree/rawmux
  * ^ Compile this branch of ffmpeg to get rawmux decoder
  * You can test that it works by doing ./ffplay /tmp/glcapture.fifo
+ * Nothing gets captured while there is no reader, so it's fine to keep glcapture preloaded.
  *
  * Make sure you increase your maximum pipe size /prox/sys/fs/pipe-max-size to minimum of
  * (FPS / 4) * ((width * height * components) + 13) where components is 3 on OpenGL and 4 on OpenGL ES.
  * Also set /proc/sys/fs/pipe-user-pages-soft to 0.
  *
+ * Read the fifo with plain reads, or set SPLICE_FRAMES to false if the reader splices or tees it onwards.
+ *
+ * Alternatively set TRANSPORT to TRANSPORT_SHM, which needs none of the above.
+ * Then read the stream with ./rawshmcat | ./ffplay -
+ *
+ * TRANSPORT_REPLAY keeps the last REPLAY_SECONDS in memory instead, and saves them to a rawmux file
+ * on kill -USR1 <pid> or echo save > /tmp/glcapture.control
+ *
  * If you get xruns from alsa, consider increasing your audio buffer size.
+ *
+ * With RECONFIGURE_PACKETS a resolution or audio format change doesn't reopen the pipe, instead a packet with
+ * stream id RAWMUX_RECONFIGURE carries a new rawmux header, and the packets after it follow that header.
  */
 
 /**
@@ -34,8 +46,15 @@
 #include <time.h>
 #include <err.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sched.h>
 
 #include <GL/glx.h>
 #include <EGL/egl.h>
@@ -46,42 +65,185 @@
 
 // Use any amount you want as long as you have the vram for it
 // If you get warning of map_buffer taking time, try increasing this
+// Only used when persistently mapped buffers aren't available, otherwise the PBO ring sizes itself up to MAX_PBOS
 #define NUM_PBOS 4
+#define MAX_PBOS 16
+
+// Frames between checks whether the self sizing PBO ring could shrink
+#define PBO_SHRINK_FRAMES 120
+
+// Number of captured frames that can be waiting for the mux thread
+// If the pipe can't keep up and all of these are in use, frames get dropped instead of stalling the game
+#define NUM_FRAMES 4
+
+// Compress rgb video losslessly on this many worker threads before it's written out, 0 disables
+// Frames are split to COMPRESS_STRIPES horizontal stripes, which get compressed in parallel and written as their own packets
+// Stream then needs to go through ./rawunstripe before ffmpeg can read it (see rawstripe.h), GPU_YUV video isn't compressed
+static uint32_t COMPRESS_THREADS = 0;
+#define COMPRESS_STRIPES 8
+
+// Only send the DELTA_TILE sized tiles of the rgb video that changed since the previous frame, and a tiny packet
+// for frames that didn't change at all. Great for menus and anything else that's mostly static.
+// Stream then needs to go through ./rawuntile before ffmpeg can read it (see rawtile.h)
+// Not used together with COMPRESS_THREADS or TRANSPORT_REPLAY, replays have to be playable from any point
+static bool DELTA_FRAMES = false;
+#define DELTA_TILE 64
+
+// Announce changed streams (resolution, audio format, new audio tracks) in band instead of reopening the pipe
+// Readers have to understand the reconfiguration packet, ./rawunstripe and ./rawuntile do, ffmpeg's rawmux demuxer doesn't
+// Replays still drop what was captured before the change, a saved replay has only one header
+static bool RECONFIGURE_PACKETS = false;
+#define RAWMUX_RECONFIGURE 0xff
+
+// Same as above but for audio packets, these are small so we can afford to queue a lot more of them
+#define NUM_AUDIO_PACKETS 256
+
+// Consecutive audio writes are gathered into packets of this many milliseconds, 0 makes every write its own packet
+// Games with tiny periods would otherwise produce thousands of packets a second
+// Gathered audio is flushed early whenever video is muxed, so interleaving doesn't suffer
+static uint32_t AUDIO_PACKET_MS = 20;
+
+enum overflow {
+   OVERFLOW_DROP_NEWEST,
+   OVERFLOW_DROP_OLDEST,
+};
+
+// What to do when the reader can't keep up, the game itself is never slowed down either way
+// OVERFLOW_DROP_NEWEST drops whatever doesn't fit to the queues, so queued video gets old before it's written
+// OVERFLOW_DROP_OLDEST skips stale queued video once the queue is almost full, which keeps video latency low
+// and leaves more of the bandwidth to audio, audio is never skipped
+// Dropped packets show up as gaps in the PTS, rawmux has no other way to mark discontinuities
+static enum overflow OVERFLOW = OVERFLOW_DROP_OLDEST;
+
+// Seconds between reports of dropped packets, if there were any
+#define DROP_REPORT_INTERVAL 5
+
+// vmsplice video frames into the fifo instead of copying them with write
+// Buffers are reused once a pipe's worth of pages went in after them, which is only safe when the reader copies
+// out of the pipe (read, like ffmpeg and cat do). A reader that splices or tees the pipe onwards still references
+// our pages past that point and would see them overwritten, set this to false for such readers
+static bool SPLICE_FRAMES = true;
+
+// Number of frames that may sit in the pipe as vmspliced pages at once
+// Past this we fall back to copying the frame into the pipe with write
+#define NUM_SPLICED 32
+
+// How long the mux thread may hold back a packet, waiting for other streams that might still produce older data
+#define MUX_WAIT_MS 100
 
 // Target framerate for the video stream
 static uint32_t TARGET_FPS = 60;
 
-// Drop frames if going over target framerate
-// Set this to false if you want frame perfect capture
+// Capture video on a constant frame rate timeline of TARGET_FPS slots, frames are stamped with their slot's time
+// Frames landing on a slot that already has one are dropped before reading them back, slots the game didn't
+// render are left as gaps in the PTS (players hold the previous frame over them)
+// Set this to false if you want frame perfect capture, stamped with the time of the swap
 // If your target framerate is lower than game framerate set this to true (i.e. you want to record at lower fps)
 static bool DROP_FRAMES = true;
 
 // Multiplier for system clock. Can be used to make recordings of replays smoother (or speed hack)
-static double SPEED_HACK = 1.0;
+// Applies to clock_gettime (except CPU time clocks), gettimeofday and time
+#define SPEED_HACK 1.0
+
+// Offline capture of replays and demos, the game's clock advances exactly 1 / TARGET_FPS per swap instead of with
+// real time, and swaps wait while the mux is behind, so every frame gets captured however slow the reader is
+// Audio is stamped on the same clock and writers are held back while they're ahead of it. Overrides SPEED_HACK
+// Clock only moves when the game swaps, so games that wait for time to pass without rendering will hang
+static bool LOCKSTEP = false;
+
+// How far audio writes may run ahead of the LOCKSTEP clock before they have to wait for swaps, like a device buffer
+#define LOCKSTEP_AUDIO_AHEAD_MS 100
+
+// SPEED_HACK in 32.32 fixed point, and whether the time hooks have anything to do at all
+// Both fold at compile time, so with the defaults the hooks are just a call to the real function
+#define SPEED_HACK_Q32 ((uint64_t)(SPEED_HACK * 4294967296.0))
+#define TIME_SCALING (LOCKSTEP || SPEED_HACK_Q32 != (uint64_t)1 << 32)
 
 // If your video is upside down set this to false
 static bool FLIP_VIDEO = true;
 
+// Part of the game's frame to capture as x, y, width, height from the top-left corner of the image
+// Zero width or height captures the whole frame
+static uint32_t CROP[4] = { 0, 0, 0, 0 };
+
+// Resolution of the video stream, captured frame gets scaled to this on the GPU (needs OpenGL 3.0 or OpenGL ES 3.0)
+// If only one of these is set, the other one follows the aspect ratio. Zero for both captures at game resolution.
+static uint32_t OUTPUT_WIDTH = 0, OUTPUT_HEIGHT = 0;
+
+// Convert video to yuv420p on the GPU before reading it back, which halves the readback and pipe bandwidth
+// Needs OpenGL 3.0 or OpenGL ES 3.0, otherwise rgb is captured as usual
+// Width gets cropped to multiple of 8 and height to multiple of 4
+static bool GPU_YUV = false;
+
 // Path for the fifo where glcapture will output the rawmux data
 static const char *FIFO_PATH = "/tmp/glcapture.fifo";
 
+enum transport {
+   TRANSPORT_FIFO,
+   TRANSPORT_SHM,
+   TRANSPORT_REPLAY,
+};
+
+// How the rawmux data leaves the process
+// TRANSPORT_FIFO writes to the named pipe at FIFO_PATH
+// TRANSPORT_SHM writes to a shared memory ring linked at SHM_PATH, use rawshmcat to read it
+// The latter doesn't need the pipe sysctl tweaks and lets same host consumers read frames in place
+// TRANSPORT_REPLAY captures all the time into a memory ring, which is saved to REPLAY_PATH on request
+static enum transport TRANSPORT = TRANSPORT_FIFO;
+
+// Replay keeps at most this many seconds, as long as they fit to REPLAY_SIZE
+// Video is raw, so e.g. 1080p rgb at 60 fps is ~370MiB per second, use GPU_YUV and OUTPUT_WIDTH/HEIGHT to fit more
+static uint32_t REPLAY_SECONDS = 30;
+
+// Memory for the replay ring, allocated once and never grows
+static uint64_t REPLAY_SIZE = 512 * 1024 * 1024;
+
+// strftime format of the saved replays
+static const char *REPLAY_PATH = "/tmp/glcapture-%Y%m%d-%H%M%S.rawmux";
+
+// Signal that saves the replay, 0 to disable
+// Wine uses SIGUSR1 internally, use the control fifo with it instead
+static int REPLAY_SIGNAL = SIGUSR1;
+
+// Writing "save" to this fifo saves the replay
+static const char *REPLAY_CONTROL_PATH = "/tmp/glcapture.control";
+
+// Path where the shared memory ring gets linked to
+static const char *SHM_PATH = "/tmp/glcapture.shm";
+
+// Size of the shared memory ring, has to fit at least two frames
+static uint64_t SHM_SIZE = 256 * 1024 * 1024;
+
+// Path where the stats page (per stage timing histograms and counters, see rawstats.h) gets linked to, read it with rawstats
+// Stats are collected either way, NULL only keeps them from other processes
+static const char *STATS_PATH = "/tmp/glcapture.stats";
+
+// Keep a shadow of the GL state we touch by hooking the program's state changes, instead of querying the driver every frame
+// Set to false if the capture messes up the program's rendering, this means it changes the state through something we don't hook
+static const bool SHADOW_GL_STATE = true;
+
 // Debugging
 #define PROFILING false
 #define SHOW_FRAME_DROPS false
 
+// Every PCM the program plays on gets its own audio track, up to this many at the same time
+// Tracks are announced in the header, so PCMs opened after a reader attached are only captured for the next reader
+#define AUDIO_TRACKS 4
+
 enum stream {
    STREAM_VIDEO,
-   STREAM_AUDIO,
-   STREAM_LAST,
+   STREAM_AUDIO, // first of the AUDIO_TRACKS audio tracks
+   STREAM_LAST = STREAM_AUDIO + AUDIO_TRACKS,
 };
 
 // Set to false to disable stream
 static const bool ENABLED_STREAMS[STREAM_LAST] = {
-   true, // STREAM_VIDEO
-   true, // STREAM_AUDIO
+   [STREAM_VIDEO] = true,
+   [STREAM_AUDIO ... STREAM_LAST - 1] = true,
 };
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define WARN(x, ...) do { warn("glcapture: "x, ##__VA_ARGS__); } while (0)
 #define WARNX(x, ...) do { warnx("glcapture: "x, ##__VA_ARGS__); } while (0)
 #define ERRX(x, y, ...) do { errx(x, "glcapture: "y, ##__VA_ARGS__); } while (0)
@@ -91,22 +253,80 @@ static const bool ENABLED_STREAMS[STREAM_LAST] = {
 // "entrypoints" exposed to hooks.h
 static void swap_buffers(void);
 static void alsa_writei(snd_pcm_t *pcm, const void *buffer, const snd_pcm_uframes_t size, const char *caller);
+static void alsa_writen(snd_pcm_t *pcm, void **bufs, const snd_pcm_uframes_t size, const char *caller);
+static void alsa_mmap_begin(snd_pcm_t *pcm, const snd_pcm_channel_area_t *areas);
+static void alsa_mmap_commit(snd_pcm_t *pcm, const snd_pcm_uframes_t offset, const snd_pcm_uframes_t frames, const char *caller);
+static void alsa_configure(snd_pcm_t *pcm, const snd_pcm_hw_params_t *params);
+static void alsa_close(snd_pcm_t *pcm);
+static bool is_scaled_clock(clockid_t clk_id);
 static uint64_t get_fake_time_ns(clockid_t clk_id);
 static __thread GLint LAST_FRAMEBUFFER_BLIT[8];
+// alsa implements the write functions with mmap_begin/commit, and plugins write to their slaves with either
+// Non zero while one of the hooked alsa calls runs, whatever gets called from inside it isn't captured again
+static __thread uint32_t ALSA_WRITING;
 
+#include "glshadow.h"
 #include "hooks.h"
 #include "glwrangle.h"
+#include "rawshm.h"
+#include "rawstats.h"
+#include "rawstripe.h"
+#include "rawtile.h"
+#include "pixels.h"
+#include "samples.h"
+
+// Describes what glReadPixels reads into a PBO and how it becomes a video frame
+struct readback {
+   const char *video;
+   GLenum format;
+   GLint x, y;
+   uint32_t width, height; // read rectangle
+   uint32_t video_width, video_height;
+   uint8_t components, out_components;
+   bool flip;
+};
 
 struct pbo {
-   uint64_t ts;
+   struct readback readback;
+   uint64_t ts, seq;
+   size_t size;
+   void *map; // persistent mapping
+   GLsync fence;
+   GLuint obj, query; // query times the readback on the GPU
+   bool written, timed;
+};
+
+// Part of the game's framebuffer we capture from, and size of the resulting video
+struct capture_rect {
+   GLint x, y;
+   uint32_t width, height;
+   uint32_t out_width, out_height;
+   bool flip;
+};
+
+// Private render target
+struct fbo {
+   GLuint obj, tex;
    uint32_t width, height;
-   GLuint obj;
-   bool written;
+};
+
+// GPU conversion pass, src holds copy of the game's frame and dst the packed result
+struct convert {
+   struct fbo src, dst;
+   GLuint program, vao;
+   GLint size;
+   bool failed;
 };
 
 struct gl {
-   struct pbo pbo[NUM_PBOS];
+   struct pbo pbo[MAX_PBOS];
+   struct convert convert;
+   uint64_t seq; // of the next readback
+   uint64_t epoch, slot; // time of slot 0 of the video timeline (0 until the first frame), last slot that got a frame
+   uint32_t session; // of the mux, frames from older sessions are discarded
+   uint32_t since_shrink;
    uint8_t active; // pbo
+   uint8_t count, max_pending; // persistent pbos
 };
 
 struct frame_info {
@@ -125,43 +345,168 @@ struct frame_info {
    enum stream stream;
 };
 
+struct buffer {
+   void *data;
+   size_t size, allocated;
+};
+
+// Packet buffers that were vmspliced into the pipe, and can't be touched until the reader is past them (see SPLICE_FRAMES)
+struct pool {
+   struct {
+      struct buffer buffer;
+      uint64_t release;
+   } busy[NUM_SPLICED];
+
+   struct buffer spare[NUM_SPLICED];
+   uint32_t busy_head, busy_tail, spares;
+};
+
+// Ring of recent packets for TRANSPORT_REPLAY
+// Every record is a replay_record followed by the rawmux packet, records never wrap
+struct replay {
+   uint8_t *arena;
+   uint64_t size, head, tail;
+};
+
+struct replay_record {
+   uint64_t ts;
+   uint32_t size; // 0 marks the skipped end of the ring
+   uint32_t pad;
+};
+
+// Tile hashes of the last frame the reader got, and room for the next packet (DELTA_FRAMES)
+struct delta {
+   struct buffer buffer;
+   uint64_t *hash;
+   uint32_t tiles;
+   bool valid;
+};
+
 struct fifo {
    struct {
       struct frame_info info;
+      uint8_t id; // of the stream in the rawmux header and packets
    } stream[STREAM_LAST];
 
-   FILE *file;
-   uint64_t base;
+   struct pool pool;
+   struct replay replay;
+   struct delta delta;
+   struct rawshm *shm;
+   uint64_t base, spliced;
    size_t size;
    int fd;
-   bool created;
+   bool created, attached, ready, no_splice;
 };
 
-struct buffer {
-   void *data;
-   size_t size, allocated;
+struct frame {
+   struct frame_info info;
+   struct buffer buffer;
+
+   // Compressed stripes, each in its own slot of packed with room for the rawmux header in front
+   struct buffer packed;
+   uint64_t stripe_slot;
+   uint32_t stripe_size[COMPRESS_STRIPES];
+   uint32_t stripe_rows, stripes;
+   uint32_t claimed, done; // stripes taken and finished by the workers
+   uint64_t queued; // time it was submitted to the mux
+};
+
+// Frames get this as claimed while no worker may touch them
+#define STRIPES_LOCKED (1u << 31)
+
+// Single producer, single consumer ring of packets waiting for the mux thread
+// Producer lock only serializes producers of the same stream (e.g. two PCMs on different threads)
+struct queue {
+   struct frame *frame; // size of them, allocated in start_mux
+   pthread_mutex_t producer;
+   uint64_t last_submit;
+   uint64_t dropped; // by the producer, queue was full
+   uint64_t skipped; // by the mux, see OVERFLOW
+   uint64_t pending; // frames in the open audio packet at head, see AUDIO_PACKET_MS
+   uint32_t head, tail, size;
+};
+
+struct mux {
+   struct queue queue[STREAM_LAST];
+   struct fifo fifo;
+   pthread_t thread;
+   sem_t wake;
+   sem_t work; // one post per stripe to compress
+   uint32_t workers;
+   uint32_t session; // 0 while there's no reader, producers skip all work then
+   uint32_t save_replay; // set from signal handler or control thread
 };
 
-#define PROFILE(x, warn_ms, name) do { \
-   const uint64_t start = get_time_ns_clock(CLOCK_PROCESS_CPUTIME_ID); \
+// Points to the shared stats page once there is one
+static struct rawstats STATS_LOCAL;
+static struct rawstats *STATS = &STATS_LOCAL;
+
+static void
+stats_record(const enum rawstats_stage stage, const uint64_t ns)
+{
+   rawstats_record(&__atomic_load_n(&STATS, __ATOMIC_ACQUIRE)->stage[stage], ns);
+}
+
+static void
+stats_count(const enum rawstats_counter counter, const uint64_t n)
+{
+   rawstats_add(&__atomic_load_n(&STATS, __ATOMIC_ACQUIRE)->counter[counter], n);
+}
+
+// Wall time, so stalls on the GPU and locks count as well
+#define PROFILE(x, warn_ms, stage) do { \
+   const uint64_t start = get_time_ns(); \
    x; \
-   const double ms = (get_time_ns_clock(CLOCK_PROCESS_CPUTIME_ID) - start) / 1e6; \
-   if (PROFILING && ms >= warn_ms) WARNX("WARNING: %s took %.2f ms (>=%.0fms)", name, ms, warn_ms); \
+   const uint64_t ns = get_time_ns() - start; \
+   stats_record(stage, ns); \
+   if (PROFILING && ns / 1e6 >= warn_ms) WARNX("WARNING: %s took %.2f ms (>=%.0fms)", rawstats_stage_name(stage), ns / 1e6, warn_ms); \
 } while (0)
 
+static size_t
+page_size(void)
+{
+   static size_t size;
+   return (size ? size : (size = sysconf(_SC_PAGESIZE)));
+}
+
 static void
-buffer_resize(struct buffer *buffer, const size_t size)
+packet_resize(struct buffer *buffer, const size_t size)
 {
-   if (buffer->allocated < size) {
-      if (!(buffer->data = realloc(buffer->data, size)))
-         ERR(EXIT_FAILURE, "realloc(%p, %zu)", buffer->data, size);
+   // Packets live in their own page aligned mappings with a page of headroom in front for the rawmux header.
+   // This lets us vmsplice the whole packet into the pipe without copying it.
+   const size_t page = page_size();
+   const size_t needed = page + ((size + page - 1) & ~(page - 1));
+
+   if (buffer->allocated < needed) {
+      void *base;
+      if (buffer->data) {
+         base = mremap((uint8_t*)buffer->data - page, buffer->allocated, needed, MREMAP_MAYMOVE);
+      } else {
+         base = mmap(NULL, needed, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      }
 
-      buffer->allocated = size;
+      if (base == MAP_FAILED)
+         ERR(EXIT_FAILURE, "mmap(%zu)", needed);
+
+      // Don't let fork() turn pages the pipe still references into copy-on-write pages
+      madvise(base, needed, MADV_DONTFORK);
+      buffer->data = (uint8_t*)base + page;
+      buffer->allocated = needed;
    }
 
    buffer->size = size;
 }
 
+static void
+packet_release(struct buffer *buffer)
+{
+   // Kernel keeps its own references to pages that are still in a pipe, so unmapping is always safe
+   if (buffer->data)
+      munmap((uint8_t*)buffer->data - page_size(), buffer->allocated);
+
+   *buffer = (struct buffer){0};
+}
+
 static uint64_t
 get_time_ns_clock(clockid_t clk_id)
 {
@@ -174,38 +519,223 @@ get_time_ns_clock(clockid_t clk_id)
 static uint64_t
 get_time_ns(void)
 {
-   return get_time_ns_clock(CLOCK_MONOTONIC_COARSE);
+   // Coarse clock is jiffy resolution, which shows up as jitter in the PTS
+   return get_time_ns_clock(CLOCK_MONOTONIC);
+}
+
+// Nearest slot of the TARGET_FPS timeline, and the other way around
+// Slot times are computed from the epoch rather than accumulated, so long recordings don't drift
+static uint64_t
+timeline_slot(const uint64_t epoch, const uint64_t ts)
+{
+   const uint64_t elapsed = ts - epoch;
+   return (elapsed / 1000000000) * TARGET_FPS + ((elapsed % 1000000000) * TARGET_FPS + 500000000) / 1000000000;
+}
+
+static uint64_t
+timeline_time(const uint64_t epoch, const uint64_t slot)
+{
+   return epoch + (slot / TARGET_FPS) * 1000000000 + (slot % TARGET_FPS) * 1000000000 / TARGET_FPS;
+}
+
+// Virtual clock of LOCKSTEP, swaps so far on a TARGET_FPS timeline
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t tick;
+   uint64_t epoch, swaps;
+   uint64_t stalled; // swaps + 1 when the clock was last waited for in vain
+   bool swapping; // clock will move once the swap in progress is captured
+} LOCKSTEP_CLOCK = { .lock = PTHREAD_MUTEX_INITIALIZER, .tick = PTHREAD_COND_INITIALIZER };
+
+static uint64_t
+lockstep_time_ns(void)
+{
+   // Clock starts from real time the first time anyone looks at it
+   uint64_t epoch = __atomic_load_n(&LOCKSTEP_CLOCK.epoch, __ATOMIC_ACQUIRE);
+   if (!epoch) {
+      const uint64_t now = get_time_ns();
+      epoch = (__atomic_compare_exchange_n(&LOCKSTEP_CLOCK.epoch, &epoch, now, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? now : epoch);
+   }
+
+   return timeline_time(epoch, __atomic_load_n(&LOCKSTEP_CLOCK.swaps, __ATOMIC_ACQUIRE));
+}
+
+static void
+lockstep_advance(void)
+{
+   pthread_mutex_lock(&LOCKSTEP_CLOCK.lock);
+   __atomic_store_n(&LOCKSTEP_CLOCK.swaps, LOCKSTEP_CLOCK.swaps + 1, __ATOMIC_RELEASE);
+   __atomic_store_n(&LOCKSTEP_CLOCK.swapping, false, __ATOMIC_RELAXED);
+   pthread_cond_broadcast(&LOCKSTEP_CLOCK.tick);
+   pthread_mutex_unlock(&LOCKSTEP_CLOCK.lock);
+}
+
+// Blocks until the virtual clock reaches ts
+// Gives up if the game goes a second without swapping, and doesn't wait again until it swaps
+static void
+lockstep_wait_until(const uint64_t ts)
+{
+   HOOK(clock_gettime);
+   pthread_mutex_lock(&LOCKSTEP_CLOCK.lock);
+   while (lockstep_time_ns() < ts && LOCKSTEP_CLOCK.stalled != LOCKSTEP_CLOCK.swaps + 1) {
+      struct timespec deadline;
+      _clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += 1;
+
+      if (pthread_cond_timedwait(&LOCKSTEP_CLOCK.tick, &LOCKSTEP_CLOCK.lock, &deadline) == ETIMEDOUT &&
+          !__atomic_load_n(&LOCKSTEP_CLOCK.swapping, __ATOMIC_RELAXED))
+         LOCKSTEP_CLOCK.stalled = LOCKSTEP_CLOCK.swaps + 1;
+   }
+   pthread_mutex_unlock(&LOCKSTEP_CLOCK.lock);
+}
+
+static void
+pool_put(struct pool *pool, struct buffer *buffer)
+{
+   if (pool->spares < ARRAY_SIZE(pool->spare)) {
+      pool->spare[pool->spares++] = *buffer;
+      *buffer = (struct buffer){0};
+   } else {
+      packet_release(buffer);
+   }
+}
+
+static void
+pool_collect(struct pool *pool, const uint64_t spliced, const uint64_t capacity)
+{
+   // Pipe holds at most capacity pages, so once that many pages were spliced after a buffer, a reader that copies
+   // out of the pipe has consumed it and we can reuse the memory. Readers that splice it onwards break this.
+   for (; pool->busy_tail != pool->busy_head; pool->busy_tail = (pool->busy_tail + 1) % NUM_SPLICED) {
+      if (spliced - pool->busy[pool->busy_tail].release < capacity)
+         break;
+
+      pool_put(pool, &pool->busy[pool->busy_tail].buffer);
+   }
+}
+
+static void
+close_shm(struct fifo *fifo)
+{
+   if (!fifo->shm)
+      return;
+
+   // Reader keeps its own mapping, so it can still drain whatever was written
+   rawshm_store(&fifo->shm->state, RAWSHM_CLOSED);
+   munmap(fifo->shm, fifo->size);
+   remove(SHM_PATH);
 }
 
 static void
 reset_fifo(struct fifo *fifo)
 {
+   close_shm(fifo);
    close(fifo->fd);
+
+   // Whatever is left in the old pipe can't be tracked anymore
+   struct pool pool = fifo->pool;
+   for (; pool.busy_tail != pool.busy_head; pool.busy_tail = (pool.busy_tail + 1) % NUM_SPLICED)
+      packet_release(&pool.busy[pool.busy_tail].buffer);
+
+   // Replay arena stays, the packets in it don't as they may not match the new streams
+   const struct replay replay = { .arena = fifo->replay.arena, .size = fifo->replay.size };
+
+   // So do the delta buffers, but the next reader has to start from a key frame
+   struct delta delta = fifo->delta;
+   delta.valid = false;
+
    memset(fifo, 0, sizeof(*fifo));
+   fifo->pool = pool;
+   fifo->replay = replay;
+   fifo->delta = delta;
    fifo->fd = -1;
    WARNX("reseting fifo");
 }
 
 static bool
-write_rawmux_header(struct fifo *fifo)
+write_all(const int fd, const void *data, const size_t size)
 {
-   uint8_t header[255] = { 'r', 'a', 'w', 'm', 'u', 'x' };
+   for (size_t off = 0; off < size;) {
+      const ssize_t ret = write(fd, (const uint8_t*)data + off, size - off);
 
-   size_t variable_sz = 0;
-   for (enum stream i = 0; i < STREAM_LAST; ++i)
-      variable_sz += (fifo->stream[i].info.format ? strlen(fifo->stream[i].info.format) : 0);
+      if (ret < 0 && errno == EINTR)
+         continue;
 
-   if (variable_sz + 33 > sizeof(header)) {
-      warnx("something went wrong");
-      reset_fifo(fifo);
+      if (ret <= 0)
+         return false;
+
+      off += ret;
+   }
+
+   return true;
+}
+
+static bool
+splice_all(struct fifo *fifo, struct buffer *buffer, const uint8_t *data, const size_t size)
+{
+   struct pool *pool = &fifo->pool;
+   const uint64_t capacity = fifo->size / page_size();
+   pool_collect(pool, fifo->spliced, capacity);
+
+   if ((pool->busy_head + 1) % NUM_SPLICED == pool->busy_tail)
       return false;
+
+   // SPLICE_F_GIFT is not used, as we recycle the pages once the reader is past them
+   struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+   while (iov.iov_len > 0) {
+      const ssize_t ret = vmsplice(fifo->fd, &iov, 1, 0);
+
+      if (ret < 0 && errno == EINTR)
+         continue;
+
+      if (ret <= 0) {
+         if (iov.iov_base == data && (errno == EINVAL || errno == ENOSYS)) {
+            WARNX("vmsplice not supported, falling back to write");
+            fifo->no_splice = true;
+            return false;
+         }
+
+         WARN("vmsplice(%zu)", iov.iov_len);
+         reset_fifo(fifo);
+         return true;
+      }
+
+      iov.iov_base = (uint8_t*)iov.iov_base + ret;
+      iov.iov_len -= ret;
+   }
+
+   // The pages now belong to the pipe, hand the frame a spare buffer to fill next time
+   const uintptr_t page = page_size();
+   fifo->spliced += (((uintptr_t)data + size + page - 1) / page) - ((uintptr_t)data / page);
+   pool->busy[pool->busy_head].buffer = *buffer;
+   pool->busy[pool->busy_head].release = fifo->spliced;
+   pool->busy_head = (pool->busy_head + 1) % NUM_SPLICED;
+   *buffer = (pool->spares ? pool->spare[--pool->spares] : (struct buffer){0});
+   return true;
+}
+
+static size_t
+get_rawmux_header(struct fifo *fifo, uint8_t header[255])
+{
+   // Format strings are terminated by the zeroes
+   memset(header, 0, 255);
+   memcpy(header, (uint8_t[]){ 'r', 'a', 'w', 'm', 'u', 'x' }, 6);
+
+   // Magic, version and terminator, then 18 and 7 bytes per video and audio stream plus the format strings
+   size_t needed = 8;
+   for (enum stream i = 0; i < STREAM_LAST; ++i) {
+      if (fifo->stream[i].info.format)
+         needed += (i == STREAM_VIDEO ? 18 : 7) + strlen(fifo->stream[i].info.format);
    }
 
-   uint8_t *p = header + 6;
+   if (needed > 255)
+      return 0;
+
+   uint8_t *p = header + 6, id = 0;
    memcpy(p, (uint8_t[]){1}, sizeof(uint8_t)); p += 1;
 
    if (fifo->stream[STREAM_VIDEO].info.format) {
       const struct frame_info *info = &fifo->stream[STREAM_VIDEO].info;
+      fifo->stream[STREAM_VIDEO].id = id++;
       memcpy(p, (uint8_t[]){1}, sizeof(uint8_t)); p += 1;
       memcpy(p, info->format, strlen(info->format)); p += strlen(info->format) + 1;
       memcpy(p, (uint32_t[]){1}, sizeof(uint32_t)); p += 4;
@@ -214,15 +744,46 @@ write_rawmux_header(struct fifo *fifo)
       memcpy(p, &info->video.height, sizeof(uint32_t)); p += 4;
    }
 
-   if (fifo->stream[STREAM_AUDIO].info.format) {
-      const struct frame_info *info = &fifo->stream[STREAM_AUDIO].info;
+   for (enum stream i = STREAM_AUDIO; i < STREAM_LAST; ++i) {
+      if (!fifo->stream[i].info.format)
+         continue;
+
+      const struct frame_info *info = &fifo->stream[i].info;
+      fifo->stream[i].id = id++;
       memcpy(p, (uint8_t[]){2}, sizeof(uint8_t)); p += 1;
       memcpy(p, info->format, strlen(info->format)); p += strlen(info->format) + 1;
       memcpy(p, &info->audio.rate, sizeof(info->audio.rate)); p += 4;
       memcpy(p, &info->audio.channels, sizeof(info->audio.channels)); p += 1;
    }
 
-   return (fwrite(header, 1, (p + 1) - header, fifo->file) == (size_t)((p + 1) - header));
+   *p = 0;
+   return (p + 1) - header;
+}
+
+static bool
+write_rawmux_header(struct fifo *fifo)
+{
+   uint8_t header[255];
+   const size_t size = get_rawmux_header(fifo, header);
+
+   if (!size) {
+      warnx("something went wrong");
+      reset_fifo(fifo);
+      return false;
+   }
+
+   // Replays get their header when they are saved
+   if (TRANSPORT == TRANSPORT_REPLAY)
+      return true;
+
+   if (fifo->shm) {
+      memcpy(fifo->shm->header, header, size);
+      fifo->shm->header_size = size;
+      rawshm_store(&fifo->shm->state, RAWSHM_STREAMING);
+      return true;
+   }
+
+   return write_all(fifo->fd, header, size);
 }
 
 static bool
@@ -242,18 +803,8 @@ stream_info_changed(const struct frame_info *current, const struct frame_info *l
 }
 
 static bool
-check_and_prepare_stream(struct fifo *fifo, const struct frame_info *info)
+open_fifo(struct fifo *fifo)
 {
-   if (!ENABLED_STREAMS[info->stream])
-      return false;
-
-   if (fifo->stream[info->stream].info.format && stream_info_changed(info, &fifo->stream[info->stream].info)) {
-      WARNX("stream information has changed");
-      reset_fifo(fifo);
-   }
-
-   fifo->stream[info->stream].info = *info;
-
    if (!fifo->created) {
       remove(FIFO_PATH);
 
@@ -266,239 +817,1924 @@ check_and_prepare_stream(struct fifo *fifo, const struct frame_info *info)
    if (fifo->fd < 0) {
       signal(SIGPIPE, SIG_IGN);
 
-      if ((fifo->fd = open(FIFO_PATH, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+      // Readers block in open until there's a writer, so to notice them we keep the write end open even without readers
+      // Write end can't be opened alone without blocking, so open the fifo for reading too for a moment
+      int lure;
+      if ((lure = open(FIFO_PATH, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
          return false;
 
-      // We will use fwrite instead of write for buffered writes.
-      // Which will be more stable, since audio/video data isn't actually that large per frame.
-      // We also avoid calling to kernel each call.
-      fifo->file = fdopen(fifo->fd, "wb");
-      assert(fifo->file);
-
-      const int flags = fcntl(fifo->fd, F_GETFL);
-      fcntl(fifo->fd, F_SETFL, flags & ~O_NONBLOCK);
-      WARNX("stream ready, writing headers");
+      fifo->fd = open(FIFO_PATH, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+      close(lure);
 
-      if (!write_rawmux_header(fifo))
+      if (fifo->fd < 0)
          return false;
 
-      fifo->base = info->ts;
+      const int flags = fcntl(fifo->fd, F_GETFL);
+      fcntl(fifo->fd, F_SETFL, flags & ~O_NONBLOCK);
    }
 
-   return true;
+   // Write end of a pipe polls POLLERR while there are no readers
+   struct pollfd pfd = { .fd = fifo->fd, .events = POLLOUT };
+   return (poll(&pfd, 1, 0) == 1 && !(pfd.revents & POLLERR));
 }
 
-static void
-write_data_unsafe(struct fifo *fifo, const struct frame_info *info, const void *buffer, const size_t size)
+static bool
+open_shm(struct fifo *fifo)
 {
-   if (!check_and_prepare_stream(fifo, info) || info->ts < fifo->base)
-      return;
-
-   const uint64_t den[STREAM_LAST] = { 1e6, 1e9 };
-   const uint64_t rate = (info->stream == STREAM_VIDEO ? info->video.fps : info->audio.rate);
-   const uint64_t pts = (info->ts - fifo->base) / (den[info->stream] / rate);
-
-#if 0
-   WARNX("PTS: (%u) %llu", info->stream, pts);
-#endif
-
-   uint8_t frame[] = {
-      info->stream,
-      0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0
-   };
+   if (!fifo->shm) {
+      const size_t offset = page_size();
+      const size_t size = offset + (SHM_SIZE & ~(uint64_t)(RAWSHM_RECORD_ALIGN - 1));
 
-   memcpy(frame + 1, (uint32_t[]){size}, sizeof(uint32_t));
-   memcpy(frame + 1 + 4, (uint64_t[]){pts}, sizeof(uint64_t));
+      if ((fifo->fd = memfd_create("glcapture", MFD_CLOEXEC)) < 0) {
+         WARN_ONCE("memfd_create");
+         return false;
+      }
 
-   {
-      const size_t pipe_sz = (TARGET_FPS / 4) * (size + sizeof(frame));
+      if (ftruncate(fifo->fd, size) == -1 ||
+          (fifo->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fifo->fd, 0)) == MAP_FAILED) {
+         WARN("shm(%zu)", size);
+         fifo->shm = NULL;
+         reset_fifo(fifo);
+         return false;
+      }
 
-      if (fifo->size < pipe_sz) {
-         if (fcntl(fifo->fd, F_SETPIPE_SZ, pipe_sz) == -1) {
-            WARN("fcntl(F_SETPIPE_SZ, %zu) (%u)", pipe_sz, info->stream);
-            reset_fifo(fifo);
-            return;
-         }
+      fifo->size = size;
+      memcpy(fifo->shm->magic, RAWSHM_MAGIC, sizeof(RAWSHM_MAGIC));
+      fifo->shm->version = RAWSHM_VERSION;
+      fifo->shm->offset = offset;
+      fifo->shm->size = size - offset;
 
-         fifo->size = pipe_sz;
+      // Readers find the memfd through our /proc entry
+      char target[64];
+      snprintf(target, sizeof(target), "/proc/%d/fd/%d", getpid(), fifo->fd);
+      remove(SHM_PATH);
 
-         // Set some reasonable buffer size for fwrites
-         // This is still experimental and if you get smoother output by setting this to
-         // _IONBF let me know.
-         setvbuf(fifo->file, NULL, _IOFBF, fifo->size / 8);
+      if (symlink(target, SHM_PATH) == -1) {
+         WARN("symlink(%s, %s)", target, SHM_PATH);
+         reset_fifo(fifo);
+         return false;
       }
    }
 
-   errno = 0;
-   size_t ret;
-   if ((ret = fwrite(frame, 1, sizeof(frame), fifo->file) != sizeof(frame)) ||
-      ((ret = fwrite(buffer, 1, size, fifo->file)) != size)) {
-      WARN("write(%zu) (%u)", ret, info->stream);
-      reset_fifo(fifo);
-   }
+   return (rawshm_load(&fifo->shm->state) == RAWSHM_ATTACHED);
 }
 
 static void
-write_data(const struct frame_info *info, const void *buffer, const size_t size)
+open_stats(void)
 {
-   // we need to protect our fifo structure, since games usually output audio on another thread and so
-   static struct fifo fifo = { .fd = -1 };
-   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-   pthread_mutex_lock(&mutex);
-   write_data_unsafe(&fifo, info, buffer, size);
-   pthread_mutex_unlock(&mutex);
-}
+   if (!STATS_PATH)
+      return;
 
-void
-flip_pixels_if_needed(const GLint view[8], uint8_t *pixels, const uint32_t width, const uint32_t height, const uint8_t components)
-{
-   // Will detect at least wine which blits viewport sized framebuffer at the end already flipped
-   if (!FLIP_VIDEO || (view[5] == view[3] && view[6] == view[2]))
+   int fd;
+   struct rawstats *stats;
+   if ((fd = memfd_create("glcapture-stats", MFD_CLOEXEC)) < 0) {
+      WARN("memfd_create");
       return;
+   }
+
+   if (ftruncate(fd, sizeof(*stats)) == -1 ||
+       (stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      WARN("stats(%zu)", sizeof(*stats));
+      close(fd);
+      return;
+   }
 
-   // Sadly I can't come up with any reliable way to do this on GPU on all possible OpenGL versions and variants.
-   // FIXME: This function however is quite expensive and causes capture to take more than 1ms easily.
-   //        Should try dig deeper and see how I could make GPU do the flip without having to read twice.
+   memcpy(stats->magic, RAWSTATS_MAGIC, sizeof(stats->magic));
+   stats->version = RAWSTATS_VERSION;
+   stats->pid = getpid();
+   stats->started = get_time_ns();
 
-   const uint32_t stride = width * components;
-   static __thread struct buffer row;
-   buffer_resize(&row, stride);
+   char target[64];
+   snprintf(target, sizeof(target), "/proc/%d/fd/%d", getpid(), fd);
+   remove(STATS_PATH);
 
-   for (uint8_t *lo = pixels, *hi = pixels + (height - 1) * stride; lo < hi; lo += stride, hi -= stride) {
-      memcpy(row.data, lo, stride);
-      memcpy(lo, hi, stride);
-      memcpy(hi, row.data, stride);
+   if (symlink(target, STATS_PATH) == -1) {
+      WARN("symlink(%s, %s)", target, STATS_PATH);
+      munmap(stats, sizeof(*stats));
+      close(fd);
+      return;
    }
+
+   // Whatever got recorded before this stays in STATS_LOCAL, it's only the first swap or so
+   __atomic_store_n(&STATS, stats, __ATOMIC_RELEASE);
 }
 
 static bool
-is_buffer(GLuint obj)
+open_replay(struct fifo *fifo)
 {
-   return (obj > 0 && glIsBuffer(obj));
+   if (fifo->replay.arena)
+      return true;
+
+   // Reserved once up front, pages get backed as the ring fills and then it stays that size
+   const uint64_t size = REPLAY_SIZE & ~(uint64_t)(sizeof(struct replay_record) - 1);
+   void *arena;
+   if ((arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+      WARN_ONCE("mmap(%llu)", (unsigned long long)size);
+      return false;
+   }
+
+   // Forked children have no use for it
+   madvise(arena, size, MADV_DONTFORK);
+   fifo->replay = (struct replay){ .arena = arena, .size = size };
+   return true;
 }
 
 static void
-capture_frame_pbo(struct gl *gl, const GLint view[8], const uint64_t ts)
+wait_for_reader(struct fifo *fifo)
 {
-   const struct {
-      const char *video;
-      GLenum format;
-      uint8_t components;
-   } frame = {
-      // XXX: Maybe on ES we should instead modify the data and remove A component?
-      //      Would save some transmission bandwidth at least (from GPU and to PIPE)
-      //      RGB also is unaligned, but seem just as fast as RGBA on Nvidia.
-      .video = (OPENGL_VARIANT == OPENGL_ES ? "rgb0" : "rgb"),
-      .format = (OPENGL_VARIANT == OPENGL_ES ? GL_RGBA : GL_RGB),
-      .components = (OPENGL_VARIANT == OPENGL_ES ? 4 : 3),
-   };
+   if (TRANSPORT == TRANSPORT_REPLAY) {
+      // Replay is always capturing, the "reader" is whoever asks to save it
+      while (!open_replay(fifo))
+         sleep(1);
+      return;
+   }
 
-   if (!is_buffer(gl->pbo[gl->active].obj)) {
-      WARNX("create pbo %u", gl->active);
-      glGenBuffers(1, &gl->pbo[gl->active].obj);
+   if (TRANSPORT == TRANSPORT_SHM) {
+      while (!open_shm(fifo)) {
+         // Reader wakes the state futex when it attaches
+         if (fifo->shm) {
+            rawshm_wait(&fifo->shm->state, RAWSHM_WAITING, 1000);
+         } else {
+            sleep(1);
+         }
+      }
+      return;
    }
 
-   struct { GLenum t; GLint o; GLint v; } map[] = {
-      { .t = GL_PACK_ALIGNMENT, .v = 1 },
-      { .t = GL_PACK_ROW_LENGTH },
-      { .t = GL_PACK_IMAGE_HEIGHT },
-      { .t = GL_PACK_SKIP_PIXELS },
-   };
+   int notify = -1;
+   while (!open_fifo(fifo)) {
+      if (fifo->fd < 0) {
+         sleep(1);
+         continue;
+      }
 
-   PROFILE(
-   glBindBuffer(GL_PIXEL_PACK_BUFFER, gl->pbo[gl->active].obj);
-   glBufferData(GL_PIXEL_PACK_BUFFER, view[2] * view[3] * frame.components, NULL, GL_STREAM_READ);
+      // Nothing but someone opening the fifo changes the answer, so sleep until that happens
+      // Check once more after adding the watch, as the reader may have opened the fifo just before it
+      if (notify < 0) {
+         if ((notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0 || inotify_add_watch(notify, FIFO_PATH, IN_OPEN) < 0)
+            WARN_ONCE("inotify(%s)", FIFO_PATH);
+         continue;
+      }
 
-   for (size_t i = 0; i < ARRAY_SIZE(map); ++i) {
-      glGetIntegerv(map[i].t, &map[i].o);
-      glPixelStorei(map[i].t, map[i].v);
+      // Timeout is only there to notice if someone replaced the fifo
+      struct pollfd pfd = { .fd = notify, .events = POLLIN };
+      if (poll(&pfd, 1, 1000) == 1) {
+         uint8_t events[4096];
+         while (read(notify, events, sizeof(events)) > 0);
+      }
    }
 
-   glReadPixels(view[0], view[1], view[2], view[3], frame.format, GL_UNSIGNED_BYTE, NULL);
-   glFlush();
+   if (notify >= 0)
+      close(notify);
+}
 
-   for (size_t i = 0; i < ARRAY_SIZE(map); ++i)
-      glPixelStorei(map[i].t, map[i].o);
+static bool
+shm_reader_alive(const struct rawshm *shm)
+{
+   return (shm->state != RAWSHM_CLOSED && shm->reader && (kill(shm->reader, 0) == 0 || errno != ESRCH));
+}
 
-   gl->pbo[gl->active].ts = ts;
-   gl->pbo[gl->active].width = view[2];
-   gl->pbo[gl->active].height = view[3];
-   gl->pbo[gl->active].written = (glGetError() == GL_NO_ERROR);
-   , 1.0, "read_frame");
+static bool
+write_shm(struct fifo *fifo, const uint8_t *data, const size_t size)
+{
+   struct rawshm *shm = fifo->shm;
+   const uint64_t need = rawshm_record_size(size);
 
-   gl->active = (gl->active + 1) % NUM_PBOS;
+   if (!shm->reader)
+      return false;
 
-   if (is_buffer(gl->pbo[gl->active].obj) && gl->pbo[gl->active].written) {
-      const struct frame_info info = {
-         .ts = gl->pbo[gl->active].ts,
-         .stream = STREAM_VIDEO,
-         .format = frame.video,
-         .video.width = gl->pbo[gl->active].width,
-         .video.height = gl->pbo[gl->active].height,
-         .video.fps = TARGET_FPS,
-      };
+   // Records never wrap, skip to the beginning if there's not enough room at the end
+   uint64_t head = shm->head;
+   const uint64_t pos = head % shm->size;
+   const uint64_t skip = (pos + need > shm->size ? shm->size - pos : 0);
 
-      void *buf;
-      const size_t size = info.video.width * info.video.height * frame.components;
+   for (;;) {
+      const uint32_t consumed = rawshm_load(&shm->consumed);
+
+      if (head + skip + need - __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) <= shm->size)
+         break;
+
+      if (!shm_reader_alive(shm))
+         return false;
+
+      rawshm_wait(&shm->consumed, consumed, 100);
+   }
+
+   uint8_t *ring = (uint8_t*)shm + shm->offset;
+
+   if (skip) {
+      memcpy(ring + pos, &(struct rawshm_record_header){ .type = RAWSHM_RECORD_SKIP }, sizeof(struct rawshm_record_header));
+      head += skip;
+   }
+
+   uint8_t *record = ring + head % shm->size;
+   memcpy(record, &(struct rawshm_record_header){ .type = RAWSHM_RECORD_PACKET, .size = size }, sizeof(struct rawshm_record_header));
+   memcpy(record + sizeof(struct rawshm_record_header), data, size);
+   __atomic_store_n(&shm->head, head + need, __ATOMIC_RELEASE);
+   rawshm_bump(&shm->written);
+   return true;
+}
+
+static uint64_t
+replay_record_size(const uint64_t size)
+{
+   return (sizeof(struct replay_record) + size + sizeof(struct replay_record) - 1) & ~(uint64_t)(sizeof(struct replay_record) - 1);
+}
+
+static uint64_t
+replay_next(const struct replay *replay, const uint64_t pos)
+{
+   // Record sizes are multiples of the record header, so there's always room for the skip marker
+   struct replay_record record;
+   memcpy(&record, replay->arena + pos % replay->size, sizeof(record));
+   return pos + (record.size ? replay_record_size(record.size) : replay->size - pos % replay->size);
+}
+
+static void
+write_replay(struct replay *replay, const uint64_t ts, const uint8_t *data, const size_t size)
+{
+   const uint64_t need = replay_record_size(size);
+
+   if (need > replay->size / 2) {
+      WARN_ONCE("packet does not fit to the replay ring (%zu), increase REPLAY_SIZE", size);
+      return;
+   }
+
+   // Records never wrap, skip to the beginning if there's not enough room at the end
+   const uint64_t pos = replay->head % replay->size;
+   const uint64_t skip = (pos + need > replay->size ? replay->size - pos : 0);
+
+   // Oldest packets make room for the new one
+   while (replay->head + skip + need - replay->tail > replay->size)
+      replay->tail = replay_next(replay, replay->tail);
+
+   if (skip) {
+      memcpy(replay->arena + pos, &(struct replay_record){0}, sizeof(struct replay_record));
+      replay->head += skip;
+   }
+
+   uint8_t *record = replay->arena + replay->head % replay->size;
+   memcpy(record, &(struct replay_record){ .ts = ts, .size = size }, sizeof(struct replay_record));
+   memcpy(record + sizeof(struct replay_record), data, size);
+   replay->head += need;
+
+   // And so do the ones that are too old to be part of the replay
+   const uint64_t window = REPLAY_SECONDS * (uint64_t)1e9;
+   for (struct replay_record oldest; replay->tail != replay->head; replay->tail = replay_next(replay, replay->tail)) {
+      memcpy(&oldest, replay->arena + replay->tail % replay->size, sizeof(oldest));
+
+      if (oldest.size && oldest.ts + window >= ts)
+         break;
+   }
+}
+
+static bool write_reconfigure(struct fifo *fifo, const struct frame_info *info);
+
+static bool
+check_and_prepare_stream(struct fifo *fifo, const struct frame_info *info)
+{
+   if (!ENABLED_STREAMS[info->stream])
+      return false;
+
+   const bool unknown = (fifo->ready && !fifo->stream[info->stream].info.format);
+   if (RECONFIGURE_PACKETS && TRANSPORT != TRANSPORT_REPLAY && fifo->ready &&
+       (unknown || stream_info_changed(info, &fifo->stream[info->stream].info))) {
+      fifo->stream[info->stream].info = *info;
+      return write_reconfigure(fifo, info);
+   }
+
+   // Header is out already, so there's no way to announce the track anymore
+   if (unknown) {
+      WARN_ONCE("audio track %u showed up after the header was written, it's captured from the next reader on", info->stream - STREAM_AUDIO);
+      return false;
+   }
+
+   if (fifo->stream[info->stream].info.format && stream_info_changed(info, &fifo->stream[info->stream].info)) {
+      WARNX("stream information has changed");
+      reset_fifo(fifo);
+      return false;
+   }
+
+   fifo->stream[info->stream].info = *info;
+
+   if (!fifo->ready) {
+      WARNX("stream ready, writing headers");
+
+      if (!write_rawmux_header(fifo))
+         return false;
+
+      fifo->base = info->ts;
+      fifo->ready = true;
+   }
+
+   return true;
+}
+
+static uint64_t
+packet_pts(const struct frame_info *info, const uint64_t ts, const uint64_t base)
+{
+   const uint64_t den = (info->stream == STREAM_VIDEO ? 1e6 : 1e9);
+   const uint64_t rate = (info->stream == STREAM_VIDEO ? info->video.fps : info->audio.rate);
+   // Scale whole units and the remainder separately, truncating den / rate would drift and ts * rate can overflow
+   // Remainder rounds to nearest, so timeline slots truncated to whole ns don't come out a tick short
+   const uint64_t elapsed = ts - base;
+   return (elapsed / den) * rate + ((elapsed % den) * rate + den / 2) / den;
+}
+
+static bool
+write_packet(struct fifo *fifo, const uint64_t ts, struct buffer *buffer, const uint8_t *packet, const size_t size)
+{
+   if (TRANSPORT == TRANSPORT_REPLAY) {
+      write_replay(&fifo->replay, ts, packet, size);
+   } else if (fifo->shm && rawshm_record_size(size) > fifo->shm->size / 2) {
+      // Reader never gets this one, so the next delta frame has to be a key frame again
+      WARN_ONCE("packet does not fit to the shm ring (%zu), dropping it, increase SHM_SIZE", size);
+      fifo->delta.valid = false;
+      stats_count(RAWSTATS_PACKETS_DROPPED, 1);
+      return true;
+   } else if (fifo->shm) {
+      if (!write_shm(fifo, packet, size)) {
+         WARNX("shm reader went away");
+         reset_fifo(fifo);
+         return false;
+      }
+   } else if (!buffer || !SPLICE_FRAMES || fifo->no_splice || !splice_all(fifo, buffer, packet, size)) {
+      // Only buffers that can be handed over to the pool are worth the page tracking
+      if (!write_all(fifo->fd, packet, size)) {
+         WARN("write(%zu) (%u)", size, packet[0]);
+         reset_fifo(fifo);
+         return false;
+      }
+   }
+
+   stats_count(RAWSTATS_PACKETS, 1);
+   stats_count(RAWSTATS_BYTES, size);
+   return true;
+}
+
+static struct buffer*
+encode_delta(struct delta *delta, const struct frame *frame)
+{
+   const uint32_t width = frame->info.video.width, height = frame->info.video.height;
+   const uint32_t tiles = rawtile_count(width, height, DELTA_TILE);
+
+   if (delta->tiles != tiles) {
+      if (!(delta->hash = realloc(delta->hash, tiles * sizeof(*delta->hash))))
+         ERR(EXIT_FAILURE, "realloc");
+
+      delta->tiles = tiles;
+      delta->valid = false;
+   }
+
+   packet_resize(&delta->buffer, rawtile_bound(width, height, DELTA_TILE));
+   delta->buffer.size = rawtile_encode(delta->buffer.data, frame->buffer.data, width, height, DELTA_TILE, delta->hash, !delta->valid);
+   delta->valid = true;
+   return &delta->buffer;
+}
+
+static bool
+write_reconfigure(struct fifo *fifo, const struct frame_info *info)
+{
+   WARNX("stream information has changed, sending new headers");
+
+   uint8_t packet[13 + 255];
+   const size_t size = get_rawmux_header(fifo, packet + 13);
+
+   if (!size) {
+      warnx("something went wrong");
+      reset_fifo(fifo);
+      return false;
+   }
+
+   // Deltas against a frame of another size make no sense
+   fifo->delta.valid = false;
+
+   packet[0] = RAWMUX_RECONFIGURE;
+   memcpy(packet + 1, (uint32_t[]){size}, sizeof(uint32_t));
+   memcpy(packet + 1 + 4, (uint64_t[]){(info->ts > fifo->base ? packet_pts(info, info->ts, fifo->base) : 0)}, sizeof(uint64_t));
+   return write_packet(fifo, info->ts, NULL, packet, size + 13);
+}
+
+static void
+write_data_unsafe(struct fifo *fifo, struct frame *frame)
+{
+   const struct frame_info *info = &frame->info;
+
+   if (!check_and_prepare_stream(fifo, info) || info->ts < fifo->base)
+      return;
+
+   const uint64_t pts = packet_pts(info, info->ts, fifo->base);
+
+#if 0
+   WARNX("PTS: (%u) %llu", info->stream, pts);
+#endif
+
+   // Delta packet is rebuilt for every frame, so unlike the frame itself it can't be spliced
+   struct buffer *payload = (info->stream == STREAM_VIDEO && !strcmp(info->format, RAWTILE_FORMAT) ? encode_delta(&fifo->delta, frame) : &frame->buffer);
+   const size_t size = payload->size;
+   size_t bytes = (frame->stripes ? 0 : size + 13);
+   for (uint32_t i = 0; i < frame->stripes; ++i)
+      bytes += frame->stripe_size[i] + 13;
+
+   if (TRANSPORT == TRANSPORT_FIFO) {
+      const size_t pipe_sz = (TARGET_FPS / 4) * bytes;
+
+      if (fifo->size < pipe_sz) {
+         int ret;
+         if ((ret = fcntl(fifo->fd, F_SETPIPE_SZ, pipe_sz)) == -1) {
+            WARN("fcntl(F_SETPIPE_SZ, %zu) (%u)", pipe_sz, info->stream);
+            reset_fifo(fifo);
+            return;
+         }
+
+         // Kernel rounds the size up, keep the real one as we use it to track spliced pages
+         fifo->size = ret;
+      }
+   }
+
+   // Header goes right before the payload, so the whole packet is contiguous
+   if (frame->stripes) {
+      for (uint32_t i = 0; i < frame->stripes; ++i) {
+         uint8_t *packet = (uint8_t*)frame->packed.data + i * frame->stripe_slot;
+         packet[0] = fifo->stream[info->stream].id;
+         memcpy(packet + 1, (uint32_t[]){frame->stripe_size[i]}, sizeof(uint32_t));
+         memcpy(packet + 1 + 4, (uint64_t[]){pts}, sizeof(uint64_t));
+
+         if (!write_packet(fifo, info->ts, NULL, packet, frame->stripe_size[i] + 13))
+            return;
+      }
+      return;
+   }
+
+   // Other buffers have a headroom page for it, audio packets are tiny and not worth the page tracking
+   uint8_t *packet = (uint8_t*)payload->data - 13;
+   packet[0] = fifo->stream[info->stream].id;
+   memcpy(packet + 1, (uint32_t[]){size}, sizeof(uint32_t));
+   memcpy(packet + 1 + 4, (uint64_t[]){pts}, sizeof(uint64_t));
+   write_packet(fifo, info->ts, (info->stream == STREAM_VIDEO && payload == &frame->buffer ? payload : NULL), packet, size + 13);
+}
+
+static void
+save_replay(struct fifo *fifo)
+{
+   const struct replay *replay = &fifo->replay;
+
+   if (!fifo->ready || replay->tail == replay->head) {
+      WARNX("nothing to save yet");
+      return;
+   }
+
+   char path[4096];
+   // Real time, not what the game sees
+   const time_t now = get_time_ns_clock(CLOCK_REALTIME) / (uint64_t)1e9;
+   struct tm tm;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+   const size_t len = strftime(path, sizeof(path), REPLAY_PATH, localtime_r(&now, &tm));
+#pragma GCC diagnostic pop
+
+   if (!len) {
+      WARNX("bad REPLAY_PATH: %s", REPLAY_PATH);
+      return;
+   }
+
+   FILE *f;
+   if (!(f = fopen(path, "wbe"))) {
+      WARN("fopen(%s)", path);
+      return;
+   }
+
+   uint8_t header[255];
+   const size_t header_size = get_rawmux_header(fifo, header);
+   bool ok = (fwrite(header, 1, header_size, f) == header_size);
+
+   // Replay starts from zero, regardless of how long we've been capturing
+   struct replay_record first;
+   memcpy(&first, replay->arena + replay->tail % replay->size, sizeof(first));
+
+   uint64_t packets = 0, bytes = header_size;
+   for (uint64_t pos = replay->tail; ok && pos != replay->head; pos = replay_next(replay, pos)) {
+      struct replay_record record;
+      const uint8_t *data = replay->arena + pos % replay->size;
+      memcpy(&record, data, sizeof(record));
+
+      if (!record.size || record.ts < first.ts)
+         continue;
+
+      // Packets are stored as they were muxed, only the pts needs to change
+      uint8_t packet[13];
+      memcpy(packet, data + sizeof(record), sizeof(packet));
+      enum stream stream = STREAM_VIDEO;
+      while (stream < STREAM_LAST && (!fifo->stream[stream].info.format || fifo->stream[stream].id != packet[0]))
+         stream++;
+
+      if (stream == STREAM_LAST)
+         continue;
+
+      const uint64_t pts = packet_pts(&fifo->stream[stream].info, record.ts, first.ts);
+      memcpy(packet + 1 + 4, &pts, sizeof(pts));
+
+      ok = (fwrite(packet, 1, sizeof(packet), f) == sizeof(packet) &&
+            fwrite(data + sizeof(record) + sizeof(packet), 1, record.size - sizeof(packet), f) == record.size - sizeof(packet));
+      bytes += record.size;
+      packets++;
+   }
+
+   if (fclose(f) != 0 || !ok) {
+      WARN("write(%s)", path);
+      return;
+   }
+
+   WARNX("saved replay of %llu packets (%.1f MiB) to %s", (unsigned long long)packets, bytes / (1024.0 * 1024.0), path);
+}
+
+static struct mux MUX = {
+   .queue = {
+      [STREAM_VIDEO] = { .producer = PTHREAD_MUTEX_INITIALIZER, .size = NUM_FRAMES },
+      [STREAM_AUDIO ... STREAM_LAST - 1] = { .producer = PTHREAD_MUTEX_INITIALIZER, .size = NUM_AUDIO_PACKETS },
+   },
+   .fifo = { .fd = -1 },
+};
+
+static struct frame*
+queue_peek(struct queue *queue)
+{
+   const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+   return (queue->tail != head ? &queue->frame[queue->tail % queue->size] : NULL);
+}
+
+static void
+settle_frame(struct frame *frame)
+{
+   // Take the frame away from the compression workers, stripes they already started have to finish though
+   // Slot stays locked until it's submitted again, so workers never see a frame that is still being filled
+   const uint32_t claimed = __atomic_exchange_n(&frame->claimed, STRIPES_LOCKED, __ATOMIC_ACQ_REL);
+   const uint32_t started = MIN(claimed, frame->stripes);
+   while (__atomic_load_n(&frame->done, __ATOMIC_ACQUIRE) < started)
+      sched_yield();
+}
+
+static void
+queue_pop(struct queue *queue)
+{
+   settle_frame(&queue->frame[queue->tail % queue->size]);
+   __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void
+mux_wait(struct mux *mux, const uint64_t timeout_ns)
+{
+   if (!timeout_ns) {
+      while (sem_wait(&mux->wake) == -1 && errno == EINTR);
+      return;
+   }
+
+   const uint64_t abs = get_time_ns_clock(CLOCK_REALTIME) + timeout_ns;
+   const struct timespec ts = { .tv_sec = abs / (uint64_t)1e9, .tv_nsec = abs % (uint64_t)1e9 };
+   while (sem_timedwait(&mux->wake, &ts) == -1 && errno == EINTR);
+}
+
+static void
+skip_stale_video(struct queue *queue)
+{
+   // Only keep the newest frame, anything older would just delay it
+   const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+   if (head - queue->tail < queue->size - 1)
+      return;
+
+   const uint32_t skip = head - queue->tail - 1;
+   for (uint32_t i = 0; i < skip; ++i)
+      settle_frame(&queue->frame[(queue->tail + i) % queue->size]);
+
+   __atomic_store_n(&queue->skipped, queue->skipped + skip, __ATOMIC_RELAXED);
+   __atomic_store_n(&queue->tail, queue->tail + skip, __ATOMIC_RELEASE);
+   stats_count(RAWSTATS_PACKETS_SKIPPED, skip);
+
+   if (SHOW_FRAME_DROPS)
+      WARNX("WARNING: skipping %u stale frames (reader is too slow)", skip);
+}
+
+static void
+report_drops(struct mux *mux, uint64_t last[STREAM_LAST])
+{
+   for (enum stream i = 0; i < STREAM_LAST; ++i) {
+      const uint64_t dropped = __atomic_load_n(&mux->queue[i].dropped, __ATOMIC_RELAXED);
+      const uint64_t skipped = __atomic_load_n(&mux->queue[i].skipped, __ATOMIC_RELAXED);
+
+      if (dropped + skipped == last[i])
+         continue;
+
+      if (i == STREAM_VIDEO) {
+         WARNX("reader is too slow, lost %llu video frames (%llu dropped, %llu skipped) in total",
+               (unsigned long long)(dropped + skipped), (unsigned long long)dropped, (unsigned long long)skipped);
+      } else {
+         WARNX("reader is too slow, lost %llu packets of audio track %u (%llu dropped, %llu skipped) in total",
+               (unsigned long long)(dropped + skipped), i - STREAM_AUDIO, (unsigned long long)dropped, (unsigned long long)skipped);
+      }
+      last[i] = dropped + skipped;
+   }
+}
+
+static bool flush_audio(const enum stream stream);
+static bool audio_track_info(const enum stream stream, struct frame_info *out_info);
+
+static void*
+mux_thread(void *arg)
+{
+   struct mux *mux = arg;
+   const uint64_t wait_ns = MUX_WAIT_MS * (uint64_t)1e6;
+   uint32_t session = 0;
+   uint64_t attached_at = 0, reported_at = 0, reported[STREAM_LAST] = {0};
+
+   for (;;) {
+      if (__atomic_exchange_n(&mux->save_replay, false, __ATOMIC_ACQ_REL))
+         save_replay(&mux->fifo);
+
+      if (!mux->fifo.attached) {
+         __atomic_store_n(&mux->session, 0, __ATOMIC_RELEASE);
+         WARNX("waiting for a reader");
+         wait_for_reader(&mux->fifo);
+
+         // Whatever got queued before the reader went away is stale
+         for (enum stream i = 0; i < STREAM_LAST; ++i) {
+            while (queue_peek(&mux->queue[i]))
+               queue_pop(&mux->queue[i]);
+         }
+
+         // So is the audio that was still being gathered
+         for (enum stream i = STREAM_AUDIO; i < STREAM_LAST; ++i) {
+            pthread_mutex_lock(&mux->queue[i].producer);
+            __atomic_store_n(&mux->queue[i].pending, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&mux->queue[i].producer);
+         }
+
+         mux->fifo.attached = true;
+         attached_at = get_time_ns();
+         __atomic_store_n(&mux->session, ++session, __ATOMIC_RELEASE);
+         WARNX("reader attached, capturing");
+         continue;
+      }
+
+      bool hold = false, all_queued = true, gathering = false;
+      struct frame *next = NULL, *head[STREAM_LAST] = {0};
+      enum stream stream = STREAM_LAST;
+      const uint64_t now = get_time_ns();
+
+      if (now - reported_at >= DROP_REPORT_INTERVAL * (uint64_t)1e9) {
+         report_drops(mux, reported);
+         reported_at = now;
+      }
+
+      // Lockstep makes the game wait instead
+      if (OVERFLOW == OVERFLOW_DROP_OLDEST && !LOCKSTEP)
+         skip_stale_video(&mux->queue[STREAM_VIDEO]);
+
+      for (enum stream i = 0; i < STREAM_LAST; ++i) {
+         gathering |= (__atomic_load_n(&mux->queue[i].pending, __ATOMIC_RELAXED) > 0);
+
+         struct frame *frame;
+         if (!(frame = head[i] = queue_peek(&mux->queue[i]))) {
+            // Stream is still alive and may give us something older than what we have
+            hold |= (now - __atomic_load_n(&mux->queue[i].last_submit, __ATOMIC_RELAXED) < wait_ns);
+            all_queued &= !(i == STREAM_VIDEO ? ENABLED_STREAMS[i] : audio_track_info(i, NULL));
+            continue;
+         }
+
+         if (!next || frame->info.ts < next->info.ts) {
+            next = frame;
+            stream = i;
+         }
+      }
+
+      if (!next) {
+         // Gathered audio doesn't wait forever if the game stops writing
+         if (gathering) {
+            mux_wait(mux, AUDIO_PACKET_MS * (uint64_t)1e6);
+            for (enum stream i = STREAM_AUDIO; i < STREAM_LAST; ++i)
+               flush_audio(i);
+         } else {
+            mux_wait(mux, 0);
+         }
+         continue;
+      }
+
+      // Audio written before this frame may still be gathered, get it queued first
+      if (stream == STREAM_VIDEO && gathering) {
+         for (enum stream i = STREAM_AUDIO; i < STREAM_LAST; ++i)
+            flush_audio(i);
+         continue;
+      }
+
+      // Header describes all the streams, so give each one a chance to show up before writing it
+      if (!mux->fifo.ready) {
+         if (!all_queued && now - attached_at < wait_ns) {
+            mux_wait(mux, wait_ns - (now - attached_at));
+            continue;
+         }
+
+         // Tracks of PCMs that are set up but had nothing to play yet get announced as well
+         for (enum stream i = 0; i < STREAM_LAST; ++i) {
+            if (head[i])
+               mux->fifo.stream[i].info = head[i]->info;
+            else if (i != STREAM_VIDEO)
+               audio_track_info(i, &mux->fifo.stream[i].info);
+         }
+      }
+
+      if (hold && now - next->info.ts < wait_ns) {
+         mux_wait(mux, wait_ns - (now - next->info.ts));
+         continue;
+      }
+
+      // Workers post when they finish the last stripe
+      if (next->stripes && __atomic_load_n(&next->done, __ATOMIC_ACQUIRE) < next->stripes) {
+         mux_wait(mux, 0);
+         continue;
+      }
+
+      // Frame may have been submitted after now was taken
+      stats_record(RAWSTATS_MUX, (now > next->queued ? now - next->queued : 0));
+      PROFILE(write_data_unsafe(&mux->fifo, next), 2.0, RAWSTATS_WRITE);
+      queue_pop(&mux->queue[stream]);
+   }
+
+   return NULL;
+}
+
+static void
+request_replay(void)
+{
+   // Only async signal safe things here
+   __atomic_store_n(&MUX.save_replay, true, __ATOMIC_RELEASE);
+   sem_post(&MUX.wake);
+}
+
+static struct sigaction REPLAY_OLD_ACTION;
+
+static void
+replay_signal(int sig, siginfo_t *info, void *context)
+{
+   request_replay();
+
+   // The program may be using the signal for something too
+   if (REPLAY_OLD_ACTION.sa_flags & SA_SIGINFO) {
+      if (REPLAY_OLD_ACTION.sa_sigaction)
+         REPLAY_OLD_ACTION.sa_sigaction(sig, info, context);
+   } else if (REPLAY_OLD_ACTION.sa_handler != SIG_DFL && REPLAY_OLD_ACTION.sa_handler != SIG_IGN) {
+      REPLAY_OLD_ACTION.sa_handler(sig);
+   }
+}
+
+static void*
+replay_control_thread(void *arg)
+{
+   (void)arg;
+   remove(REPLAY_CONTROL_PATH);
+
+   int fd;
+   // O_RDWR so that writers closing the fifo never leave us spinning on EOF
+   if (mkfifo(REPLAY_CONTROL_PATH, 0666) == -1 || (fd = open(REPLAY_CONTROL_PATH, O_RDWR | O_CLOEXEC)) < 0) {
+      WARN("%s", REPLAY_CONTROL_PATH);
+      return NULL;
+   }
+
+   char cmd[256];
+   for (ssize_t ret; (ret = read(fd, cmd, sizeof(cmd) - 1)) != 0;) {
+      if (ret < 0) {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+
+      cmd[ret] = 0;
+      if (strstr(cmd, "save")) {
+         request_replay();
+      } else {
+         WARNX("%s: unknown command: %s", REPLAY_CONTROL_PATH, cmd);
+      }
+   }
+
+   close(fd);
+   return NULL;
+}
+
+static void
+start_replay_control(void)
+{
+   if (REPLAY_SIGNAL) {
+      struct sigaction action = { .sa_sigaction = replay_signal, .sa_flags = SA_SIGINFO | SA_RESTART };
+      sigemptyset(&action.sa_mask);
+      if (sigaction(REPLAY_SIGNAL, &action, &REPLAY_OLD_ACTION) == -1)
+         WARN("sigaction(%d)", REPLAY_SIGNAL);
+   }
+
+   pthread_t thread;
+   if (pthread_create(&thread, NULL, replay_control_thread, NULL)) {
+      WARNX("pthread_create failed, %s won't work", REPLAY_CONTROL_PATH);
+      return;
+   }
+
+   pthread_setname_np(thread, "glcapture-ctl");
+   pthread_detach(thread);
+}
+
+static void
+compress_stripe(struct frame *frame, const uint32_t stripe)
+{
+   const uint32_t width = frame->info.video.width;
+   const uint32_t y = stripe * frame->stripe_rows;
+   const uint32_t rows = MIN(frame->stripe_rows, frame->info.video.height - y);
+   const struct rawstripe_header header = { .index = stripe, .count = frame->stripes, .y = y, .rows = rows };
+
+   uint8_t *packet = (uint8_t*)frame->packed.data + stripe * frame->stripe_slot;
+   memcpy(packet + 13, &header, sizeof(header));
+   frame->stripe_size[stripe] = sizeof(header) + rawstripe_encode(packet + 13 + sizeof(header), (uint8_t*)frame->buffer.data + (uint64_t)y * width * 3, width, rows);
+}
+
+static void*
+compress_thread(void *arg)
+{
+   struct mux *mux = arg;
+   struct queue *queue = &mux->queue[STREAM_VIDEO];
+
+   for (;;) {
+      while (sem_wait(&mux->work) == -1 && errno == EINTR);
+
+      // Take a stripe from the oldest frame that still has some left, so the frame the mux is waiting for
+      // gets all the help, and workers that run out of stripes there move on to newer frames
+      const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+      for (uint32_t i = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE); i != head; ++i) {
+         struct frame *frame = &queue->frame[i % queue->size];
+         const uint32_t stripe = __atomic_fetch_add(&frame->claimed, 1, __ATOMIC_ACQ_REL);
+
+         if (stripe >= frame->stripes)
+            continue;
+
+         compress_stripe(frame, stripe);
+
+         if (__atomic_add_fetch(&frame->done, 1, __ATOMIC_ACQ_REL) == frame->stripes)
+            sem_post(&mux->wake);
+         break;
+      }
+   }
+
+   return NULL;
+}
+
+static void
+prepare_stripes(struct frame *frame)
+{
+   frame->stripes = 0;
+
+   if (!MUX.workers || strcmp(frame->info.format, "rgb"))
+      return;
+
+   const uint32_t height = frame->info.video.height;
+   frame->stripe_rows = (height + COMPRESS_STRIPES - 1) / COMPRESS_STRIPES;
+   frame->stripes = (height + frame->stripe_rows - 1) / frame->stripe_rows;
+   frame->stripe_slot = (13 + sizeof(struct rawstripe_header) + rawstripe_bound(frame->info.video.width, frame->stripe_rows) + 63) & ~(uint64_t)63;
+   frame->done = 0;
+   frame->info.format = RAWSTRIPE_FORMAT;
+   packet_resize(&frame->packed, frame->stripe_slot * frame->stripes);
+}
+
+static void
+start_compress(void)
+{
+   if (sem_init(&MUX.work, 0, 0) == -1) {
+      WARN("sem_init");
+      return;
+   }
+
+   for (uint32_t i = 0; i < COMPRESS_THREADS; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, compress_thread, &MUX)) {
+         WARNX("pthread_create failed, compressing on %u threads", MUX.workers);
+         break;
+      }
+
+      pthread_setname_np(thread, "glcapture-zip");
+      pthread_detach(thread);
+      MUX.workers++;
+   }
+}
+
+static void
+start_mux(void)
+{
+   open_stats();
+
+   // Video only needs a few slots of its huge frames, the deep rings are for the audio tracks
+   for (enum stream i = 0; i < STREAM_LAST; ++i) {
+      if (!(MUX.queue[i].frame = calloc(MUX.queue[i].size, sizeof(*MUX.queue[i].frame))))
+         ERR(EXIT_FAILURE, "calloc");
+   }
+
+   if (sem_init(&MUX.wake, 0, 0) == -1)
+      ERR(EXIT_FAILURE, "sem_init");
+
+   // Don't let the game's signal handlers run on our thread
+   sigset_t all, old;
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+
+   if (pthread_create(&MUX.thread, NULL, mux_thread, &MUX))
+      ERRX(EXIT_FAILURE, "pthread_create failed");
+
+   pthread_setname_np(MUX.thread, "glcapture");
+
+   if (COMPRESS_THREADS)
+      start_compress();
+
+   if (TRANSPORT == TRANSPORT_REPLAY)
+      start_replay_control();
+
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static uint32_t
+mux_session(void)
+{
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   pthread_once(&once, start_mux);
+   return __atomic_load_n(&MUX.session, __ATOMIC_ACQUIRE);
+}
+
+static void
+lock_producer(struct queue *queue)
+{
+   // Uncontended lock is the common case, only the contended ones are worth reading the clock for
+   if (!pthread_mutex_trylock(&queue->producer)) {
+      stats_record(RAWSTATS_LOCK_WAIT, 0);
+      return;
+   }
+
+   const uint64_t start = get_time_ns();
+   pthread_mutex_lock(&queue->producer);
+   stats_record(RAWSTATS_LOCK_WAIT, get_time_ns() - start);
+}
+
+static struct frame*
+acquire_packet(const enum stream stream)
+{
+   if (!ENABLED_STREAMS[stream] || !mux_session())
+      return NULL;
+
+   struct queue *queue = &MUX.queue[stream];
+   lock_producer(queue);
+
+   if (queue->head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= queue->size) {
+      __atomic_store_n(&queue->dropped, queue->dropped + 1, __ATOMIC_RELAXED);
+      stats_count(RAWSTATS_PACKETS_DROPPED, 1);
+      pthread_mutex_unlock(&queue->producer);
+
+      if (SHOW_FRAME_DROPS)
+         WARNX("WARNING: dropping packet (%u) (mux is busy, %llu dropped)", stream, (unsigned long long)queue->dropped);
+
+      return NULL;
+   }
+
+   // The slot at head is ours until submit_packet, consumer never looks past head
+   return &queue->frame[queue->head % queue->size];
+}
+
+static void
+submit_packet(const enum stream stream)
+{
+   struct queue *queue = &MUX.queue[stream];
+   struct frame *frame = &queue->frame[queue->head % queue->size];
+   const uint32_t stripes = frame->stripes;
+
+   // Frame is complete, workers may start on it
+   if (stripes)
+      __atomic_store_n(&frame->claimed, 0, __ATOMIC_RELEASE);
+
+   frame->queued = get_time_ns();
+   __atomic_store_n(&queue->last_submit, frame->queued, __ATOMIC_RELAXED);
+   __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&queue->producer);
+   sem_post(&MUX.wake);
+
+   for (uint32_t i = 0; i < stripes; ++i)
+      sem_post(&MUX.work);
+}
+
+static bool
+audio_continues(const struct frame *frame, const uint64_t frames, const struct frame_info *info)
+{
+   if (strcmp(frame->info.format, info->format) || frame->info.audio.rate != info->audio.rate || frame->info.audio.channels != info->audio.channels)
+      return false;
+
+   // Packet pts plus the samples before it is the exact pts of every sample, so a write may only join when it follows
+   // the gathered ones without a gap (e.g. xrun or pause), writes ahead of the clock are normal buffering
+   const uint64_t expected = frame->info.ts + frames * (uint64_t)1e9 / info->audio.rate;
+   return (info->ts <= expected + AUDIO_PACKET_MS * (uint64_t)1e6);
+}
+
+// Returns room for size bytes of audio in the track's open audio packet, or in a new one
+// Caller fills it and then calls submit_audio, queue stays locked in between
+static uint8_t*
+acquire_audio(const struct frame_info *info, const size_t size)
+{
+   // Copy into the stream's own queue, the mux thread does the actual writing
+   // This way audio and video threads never wait for each others I/O
+   struct queue *queue = &MUX.queue[info->stream];
+   struct frame *frame;
+   if (!(frame = acquire_packet(info->stream)))
+      return NULL;
+
+   // Open packet sits at head and isn't counted as queued, so there's always room to keep gathering
+   if (queue->pending && !audio_continues(frame, queue->pending, info)) {
+      __atomic_store_n(&queue->pending, 0, __ATOMIC_RELAXED);
+      submit_packet(info->stream);
+
+      if (!(frame = acquire_packet(info->stream)))
+         return NULL;
+   }
+
+   const size_t offset = (queue->pending ? frame->buffer.size : 0);
+   if (!queue->pending)
+      frame->info = *info;
+
+   packet_resize(&frame->buffer, offset + size);
+   return (uint8_t*)frame->buffer.data + offset;
+}
+
+static void
+submit_audio(const enum stream stream, const snd_pcm_uframes_t frames)
+{
+   struct queue *queue = &MUX.queue[stream];
+   const struct frame *frame = &queue->frame[queue->head % queue->size];
+   const uint64_t pending = queue->pending + frames;
+   stats_count(RAWSTATS_AUDIO_FRAMES, frames);
+
+   if (pending * 1000 >= (uint64_t)frame->info.audio.rate * AUDIO_PACKET_MS) {
+      __atomic_store_n(&queue->pending, 0, __ATOMIC_RELAXED);
+      submit_packet(stream);
+      return;
+   }
+
+   // Mux still has to know the stream is alive, or it won't wait for it
+   __atomic_store_n(&queue->pending, pending, __ATOMIC_RELAXED);
+   __atomic_store_n(&queue->last_submit, get_time_ns(), __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&queue->producer);
+}
+
+// Queues the open audio packet right away, false if there wasn't one
+static bool
+flush_audio(const enum stream stream)
+{
+   // Only the mux thread flushes, its waits aren't producer contention and stay out of RAWSTATS_LOCK_WAIT
+   struct queue *queue = &MUX.queue[stream];
+   pthread_mutex_lock(&queue->producer);
+
+   if (!queue->pending) {
+      pthread_mutex_unlock(&queue->producer);
+      return false;
+   }
+
+   __atomic_store_n(&queue->pending, 0, __ATOMIC_RELAXED);
+   submit_packet(stream);
+   return true;
+}
+
+static bool
+needs_flip(const GLint view[8])
+{
+   // Will detect at least wine which blits viewport sized framebuffer at the end already flipped
+   return (FLIP_VIDEO && !(view[5] == view[3] && view[6] == view[2]));
+}
+
+static bool
+is_buffer(GLuint obj)
+{
+   return (obj > 0 && glIsBuffer(obj));
+}
+
+// Fullscreen triangle without any vertex data
+static const char *CONVERT_VERTEX =
+   "void main() {\n"
+   "   gl_Position = vec4(float((gl_VertexID & 1) * 4 - 1), float((gl_VertexID & 2) * 2 - 1), 0.0, 1.0);\n"
+   "}\n";
+
+// Packs yuv420p planes into RGBA8 target that is (w / 4) x (h * 3 / 2), so readback is exactly the planar layout.
+// Rows [0, h) are the Y plane, followed by h / 4 rows of U and h / 4 rows of V. BT.601 limited range.
+static const char *CONVERT_YUV420P =
+   "uniform highp sampler2D tex;\n"
+   "uniform ivec2 size;\n"
+   "out vec4 color;\n"
+   "float to_y(vec3 c) { return (16.0 + dot(c, vec3(65.481, 128.553, 24.966))) / 255.0; }\n"
+   "float to_u(vec3 c) { return (128.0 + dot(c, vec3(-37.797, -74.203, 112.0))) / 255.0; }\n"
+   "float to_v(vec3 c) { return (128.0 + dot(c, vec3(112.0, -93.786, -18.214))) / 255.0; }\n"
+   "vec3 px(int x, int y) { return texelFetch(tex, ivec2(x, y), 0).rgb; }\n"
+   // Sampling at the shared corner with linear filtering gives the average of the 2x2 block
+   "vec3 block(int x, int y) { return texture(tex, vec2(float(x * 2 + 1), float(y * 2 + 1)) / vec2(size)).rgb; }\n"
+   "void main() {\n"
+   "   ivec2 p = ivec2(gl_FragCoord.xy);\n"
+   "   if (p.y < size.y) {\n"
+   "      int x = p.x * 4;\n"
+   "      color = vec4(to_y(px(x, p.y)), to_y(px(x + 1, p.y)), to_y(px(x + 2, p.y)), to_y(px(x + 3, p.y)));\n"
+   "      return;\n"
+   "   }\n"
+   "   int row = p.y - size.y;\n"
+   "   bool v = (row >= size.y / 4);\n"
+   "   int i = ((v ? row - size.y / 4 : row) * (size.x / 4) + p.x) * 4;\n"
+   "   int x = i % (size.x / 2), y = i / (size.x / 2);\n"
+   "   vec3 a = block(x, y), b = block(x + 1, y), c = block(x + 2, y), d = block(x + 3, y);\n"
+   "   color = (v ? vec4(to_v(a), to_v(b), to_v(c), to_v(d)) : vec4(to_u(a), to_u(b), to_u(c), to_u(d)));\n"
+   "}\n";
+
+// Shadow getters, these only ask the driver if the program hasn't set the state since the context was made current
+
+static bool
+shadow_valid(const enum shadow_field field)
+{
+   return (SHADOW_GL_STATE && (GL_SHADOW.valid & (1 << field)));
+}
+
+static GLint
+shadow_integer(const enum shadow_field field, const GLenum pname)
+{
+   if (!shadow_valid(field)) {
+      glGetIntegerv(pname, &GL_SHADOW.value[field]);
+      GL_SHADOW.valid |= (1 << field);
+   }
+
+   return GL_SHADOW.value[field];
+}
+
+// glGetIntegerv doesn't know about queries
+static GLint
+shadow_time_query(void)
+{
+   if (!shadow_valid(SHADOW_TIME_QUERY)) {
+      glGetQueryiv(GL_TIME_ELAPSED, GL_CURRENT_QUERY, &GL_SHADOW.value[SHADOW_TIME_QUERY]);
+      GL_SHADOW.valid |= (1 << SHADOW_TIME_QUERY);
+   }
+
+   return GL_SHADOW.value[SHADOW_TIME_QUERY];
+}
+
+static void
+shadow_viewport(GLint out[4])
+{
+   if (!shadow_valid(SHADOW_VIEWPORT)) {
+      glGetIntegerv(GL_VIEWPORT, GL_SHADOW.viewport);
+      GL_SHADOW.valid |= (1 << SHADOW_VIEWPORT);
+   }
+
+   memcpy(out, GL_SHADOW.viewport, sizeof(GL_SHADOW.viewport));
+}
+
+static void
+shadow_clear_color(GLfloat out[4])
+{
+   if (!shadow_valid(SHADOW_CLEAR_COLOR)) {
+      glGetFloatv(GL_COLOR_CLEAR_VALUE, GL_SHADOW.clear_color);
+      GL_SHADOW.valid |= (1 << SHADOW_CLEAR_COLOR);
+   }
+
+   memcpy(out, GL_SHADOW.clear_color, sizeof(GL_SHADOW.clear_color));
+}
+
+static void
+shadow_color_mask(GLboolean out[4])
+{
+   if (!shadow_valid(SHADOW_COLOR_MASK)) {
+      glGetBooleanv(GL_COLOR_WRITEMASK, GL_SHADOW.color_mask);
+      GL_SHADOW.valid |= (1 << SHADOW_COLOR_MASK);
+   }
+
+   memcpy(out, GL_SHADOW.color_mask, sizeof(GL_SHADOW.color_mask));
+}
+
+static bool
+shadow_enabled(const GLenum cap)
+{
+   size_t i;
+   for (i = 0; i < ARRAY_SIZE(SHADOW_CAPS) && SHADOW_CAPS[i] != cap; ++i);
+
+   if (!SHADOW_GL_STATE || i == ARRAY_SIZE(SHADOW_CAPS) || !(GL_SHADOW.caps_valid & (1 << i))) {
+      GLboolean enabled;
+      glGetBooleanv(cap, &enabled);
+      shadow_cap(cap, enabled);
+      return enabled;
+   }
+
+   return (GL_SHADOW.caps & (1 << i));
+}
+
+struct gl_state {
+   GLint program, vao, active_texture, texture, sampler, draw_fbo, read_fbo, unpack_buffer, viewport[4];
+   GLboolean color_mask[4], caps[ARRAY_SIZE(SHADOW_CAPS)];
+};
+
+static size_t
+convert_caps(void)
+{
+   return ARRAY_SIZE(SHADOW_CAPS) - (OPENGL_VARIANT == OPENGL_ES ? 2 : 0);
+}
+
+static void
+save_gl_state(struct gl_state *state)
+{
+   state->program = shadow_integer(SHADOW_PROGRAM, GL_CURRENT_PROGRAM);
+   state->vao = shadow_integer(SHADOW_VAO, GL_VERTEX_ARRAY_BINDING);
+   state->active_texture = shadow_integer(SHADOW_ACTIVE_TEXTURE, GL_ACTIVE_TEXTURE);
+   glActiveTexture(GL_TEXTURE0);
+   state->texture = shadow_integer(SHADOW_TEXTURE, GL_TEXTURE_BINDING_2D);
+   state->sampler = (glBindSampler ? shadow_integer(SHADOW_SAMPLER, GL_SAMPLER_BINDING) : 0);
+   state->draw_fbo = shadow_integer(SHADOW_DRAW_FBO, GL_DRAW_FRAMEBUFFER_BINDING);
+   state->read_fbo = shadow_integer(SHADOW_READ_FBO, GL_READ_FRAMEBUFFER_BINDING);
+   shadow_viewport(state->viewport);
+   shadow_color_mask(state->color_mask);
+
+   // fbo_resize's glTexImage2D would otherwise upload from the game's unpack buffer instead of just allocating
+   // Without one bound and with NULL data there's no transfer, so the UNPACK_* pixel store doesn't matter
+   if ((state->unpack_buffer = shadow_integer(SHADOW_UNPACK_BUFFER, GL_PIXEL_UNPACK_BUFFER_BINDING)))
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+   for (size_t i = 0; i < convert_caps(); ++i) {
+      if ((state->caps[i] = shadow_enabled(SHADOW_CAPS[i])))
+         glDisable(SHADOW_CAPS[i]);
+   }
+}
+
+static void
+restore_gl_state(const struct gl_state *state)
+{
+   for (size_t i = 0; i < convert_caps(); ++i) {
+      if (state->caps[i])
+         glEnable(SHADOW_CAPS[i]);
+   }
+
+   glColorMask(state->color_mask[0], state->color_mask[1], state->color_mask[2], state->color_mask[3]);
+   glViewport(state->viewport[0], state->viewport[1], state->viewport[2], state->viewport[3]);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, state->read_fbo);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state->draw_fbo);
+   if (glBindSampler) glBindSampler(0, state->sampler);
+   glBindTexture(GL_TEXTURE_2D, state->texture);
+   glActiveTexture(state->active_texture);
+   glBindVertexArray(state->vao);
+   glUseProgram(state->program);
+
+   if (state->unpack_buffer)
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state->unpack_buffer);
+}
+
+static bool
+has_gpu_convert(void)
+{
+   return (OPENGL_VERSION.major >= 3 && glBlitFramebuffer && glGenFramebuffers && glDeleteFramebuffers &&
+           glBindFramebuffer && glFramebufferTexture2D && glCheckFramebufferStatus && glGenTextures &&
+           glDeleteTextures && glBindTexture && glActiveTexture && glTexImage2D && glTexParameteri &&
+           glCreateShader && glShaderSource && glCompileShader && glGetShaderiv && glGetShaderInfoLog &&
+           glDeleteShader && glCreateProgram && glAttachShader && glLinkProgram && glGetProgramiv &&
+           glGetProgramInfoLog && glDeleteProgram && glUseProgram && glGetUniformLocation && glUniform1i &&
+           glUniform2i && glGenVertexArrays && glDeleteVertexArrays && glBindVertexArray && glDrawArrays &&
+           glViewport && glColorMask && glIsEnabled);
+}
+
+static GLuint
+compile_shader(const GLenum type, const char *source)
+{
+   const char *header = (OPENGL_VARIANT == OPENGL_ES ? "#version 300 es\nprecision highp float;\nprecision highp int;\n" :
+                         (OPENGL_VERSION.major > 3 || OPENGL_VERSION.minor >= 1 ? "#version 140\n" : "#version 130\n"));
+
+   GLint ok;
+   const GLuint obj = glCreateShader(type);
+   glShaderSource(obj, 2, (const GLchar*[]){ header, source }, NULL);
+   glCompileShader(obj);
+   glGetShaderiv(obj, GL_COMPILE_STATUS, &ok);
+
+   if (!ok) {
+      char log[1024];
+      glGetShaderInfoLog(obj, sizeof(log), NULL, log);
+      WARNX("shader compilation failed: %s", log);
+      glDeleteShader(obj);
+      return 0;
+   }
+
+   return obj;
+}
+
+static bool
+fbo_resize(struct fbo *fbo, const uint32_t width, const uint32_t height)
+{
+   if (fbo->obj && fbo->width == width && fbo->height == height)
+      return true;
+
+   if (!fbo->obj) {
+      glGenFramebuffers(1, &fbo->obj);
+      glGenTextures(1, &fbo->tex);
+   }
+
+   glBindTexture(GL_TEXTURE_2D, fbo->tex);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo->obj);
+   glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fbo->tex, 0);
+   fbo->width = width;
+   fbo->height = height;
+
+   if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      WARNX("incomplete framebuffer (%ux%u)", width, height);
+      return false;
+   }
+
+   return true;
+}
+
+static void
+convert_release(struct convert *convert)
+{
+   const struct fbo *fbos[] = { &convert->src, &convert->dst };
+   for (size_t i = 0; i < ARRAY_SIZE(fbos); ++i) {
+      if (fbos[i]->obj) {
+         glDeleteFramebuffers(1, &fbos[i]->obj);
+         glDeleteTextures(1, &fbos[i]->tex);
+      }
+   }
+
+   if (convert->program)
+      glDeleteProgram(convert->program);
+
+   if (convert->vao)
+      glDeleteVertexArrays(1, &convert->vao);
+
+   *convert = (struct convert){ .failed = convert->failed };
+}
+
+static bool
+convert_init(struct convert *convert)
+{
+   if (convert->program)
+      return true;
+
+   GLuint shaders[] = {
+      compile_shader(GL_VERTEX_SHADER, CONVERT_VERTEX),
+      compile_shader(GL_FRAGMENT_SHADER, CONVERT_YUV420P),
+   };
+
+   GLint ok = (shaders[0] && shaders[1]);
+
+   if (ok) {
+      convert->program = glCreateProgram();
+      glAttachShader(convert->program, shaders[0]);
+      glAttachShader(convert->program, shaders[1]);
+      glLinkProgram(convert->program);
+      glGetProgramiv(convert->program, GL_LINK_STATUS, &ok);
+
+      if (!ok) {
+         char log[1024];
+         glGetProgramInfoLog(convert->program, sizeof(log), NULL, log);
+         WARNX("program link failed: %s", log);
+      }
+   }
+
+   for (size_t i = 0; i < ARRAY_SIZE(shaders); ++i) {
+      if (shaders[i])
+         glDeleteShader(shaders[i]);
+   }
+
+   if (!ok)
+      return false;
+
+   glUseProgram(convert->program);
+   glUniform1i(glGetUniformLocation(convert->program, "tex"), 0);
+   convert->size = glGetUniformLocation(convert->program, "size");
+   glGenVertexArrays(1, &convert->vao);
+   return true;
+}
+
+static struct capture_rect
+get_capture_rect(const GLint view[8])
+{
+   struct capture_rect rect = { .x = view[0], .y = view[1], .width = view[2], .height = view[3], .flip = needs_flip(view) };
+
+   if (CROP[2] && CROP[3]) {
+      const uint32_t x = MIN(CROP[0], rect.width), y = MIN(CROP[1], rect.height);
+      const uint32_t w = MIN(CROP[2], rect.width - x), h = MIN(CROP[3], rect.height - y);
+      // GL's origin is bottom-left, unless the frame is already upside down
+      rect.x += x;
+      rect.y += (rect.flip ? rect.height - y - h : y);
+      rect.width = w;
+      rect.height = h;
+   }
+
+   if (!rect.width || !rect.height)
+      return rect;
+
+   rect.out_width = (OUTPUT_WIDTH ? OUTPUT_WIDTH : (OUTPUT_HEIGHT ? (uint64_t)rect.width * OUTPUT_HEIGHT / rect.height : rect.width));
+   rect.out_height = (OUTPUT_HEIGHT ? OUTPUT_HEIGHT : (OUTPUT_WIDTH ? (uint64_t)rect.height * OUTPUT_WIDTH / rect.width : rect.height));
+
+   if (GPU_YUV) {
+      // yuv420p packing needs width to be multiple of 8 and height multiple of 4, crop if we aren't scaling anyways
+      const bool scaled = (rect.out_width != rect.width || rect.out_height != rect.height);
+      rect.out_width &= ~7;
+      rect.out_height &= ~3;
+
+      if (!scaled) {
+         rect.width = rect.out_width;
+         rect.height = rect.out_height;
+      }
+   }
+
+   return rect;
+}
+
+static bool
+is_scaled(const struct capture_rect *rect)
+{
+   return (rect->out_width != rect->width || rect->out_height != rect->height);
+}
+
+static bool
+blit_frame(struct convert *convert, const struct gl_state *state, const struct capture_rect *rect)
+{
+   if (!rect->out_width || !rect->out_height || !fbo_resize(&convert->src, rect->out_width, rect->out_height))
+      return false;
+
+   // Flip on the way, so the first row of our copy is the top of the image
+   const uint32_t w = rect->out_width, h = rect->out_height;
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, state->read_fbo);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, convert->src.obj);
+   glBlitFramebuffer(rect->x, rect->y, rect->x + rect->width, rect->y + rect->height,
+                     0, (rect->flip ? h : 0), w, (rect->flip ? 0 : h), GL_COLOR_BUFFER_BIT, (is_scaled(rect) ? GL_LINEAR : GL_NEAREST));
+   return true;
+}
+
+static bool
+read_blitted(struct convert *convert, struct readback *out)
+{
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, convert->src.obj);
+   out->x = out->y = 0;
+   out->width = out->video_width = convert->src.width;
+   out->height = out->video_height = convert->src.height;
+   out->flip = false;
+   return true;
+}
+
+static bool
+convert_yuv420p(struct convert *convert, struct readback *out)
+{
+   const uint32_t width = convert->src.width, height = convert->src.height;
+
+   if (!convert_init(convert) || !fbo_resize(&convert->dst, width / 4, height * 3 / 2))
+      return false;
+
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, convert->dst.obj);
+   glViewport(0, 0, convert->dst.width, convert->dst.height);
+   glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+   glUseProgram(convert->program);
+   glUniform2i(convert->size, width, height);
+   glBindVertexArray(convert->vao);
+   glBindTexture(GL_TEXTURE_2D, convert->src.tex);
+   if (glBindSampler) glBindSampler(0, 0);
+   glDrawArrays(GL_TRIANGLES, 0, 3);
+
+   // Caller reads back from our target
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, convert->dst.obj);
+
+   *out = (struct readback){
+      .video = "yuv420p",
+      .format = GL_RGBA,
+      .width = convert->dst.width,
+      .height = convert->dst.height,
+      .video_width = width,
+      .video_height = height,
+      .components = 4,
+      .out_components = 4,
+   };
+
+   return true;
+}
+
+static void
+submit_pbo(const struct pbo *pbo, const void *buf)
+{
+   const struct readback *rb = &pbo->readback;
+   const struct frame_info info = {
+      .ts = pbo->ts,
+      .stream = STREAM_VIDEO,
+      .format = rb->video,
+      .video.width = rb->video_width,
+      .video.height = rb->video_height,
+      .video.fps = TARGET_FPS,
+   };
+
+   // Copy the frame out of the PBO and let the mux thread deal with the pipe
+   // This way a slow consumer can't stall the game's rendering
+   struct frame *out;
+   if ((out = acquire_packet(STREAM_VIDEO))) {
+      PROFILE(
+      packet_resize(&out->buffer, rb->width * rb->height * rb->out_components);
+      copy_rows(out->buffer.data, buf, rb->width, rb->height, rb->components, rb->out_components, rb->flip);
+      out->info = info;
+      prepare_stripes(out);
+
+      if (!out->stripes && DELTA_FRAMES && TRANSPORT != TRANSPORT_REPLAY && !strcmp(out->info.format, "rgb"))
+         out->info.format = RAWTILE_FORMAT;
+
+      submit_packet(STREAM_VIDEO);
+      , 2.0, RAWSTATS_FLIP);
+
+      stats_count(RAWSTATS_FRAMES, 1);
+   }
+}
+
+// Only one GL_TIME_ELAPSED query can be active at a time, the game's own one takes precedence
+static bool
+begin_gpu_timer(struct pbo *pbo)
+{
+   if (!OPENGL_TIMER_QUERY)
+      return false;
+
+   if (shadow_time_query())
+      return false;
+
+   if (!pbo->query)
+      glGenQueries(1, &pbo->query);
+
+   glBeginQuery(GL_TIME_ELAPSED, pbo->query);
+   return (pbo->timed = true);
+}
+
+// Called once the readback is done, so the result is normally there, if not it isn't worth a stall
+static void
+collect_gpu_timer(struct pbo *pbo)
+{
+   if (!pbo->timed)
+      return;
+
+   pbo->timed = false;
+
+   GLint available = 0;
+   glGetQueryObjectiv(pbo->query, GL_QUERY_RESULT_AVAILABLE, &available);
+
+   if (!available)
+      return;
+
+   GLuint64 ns = 0;
+   glGetQueryObjectui64v(pbo->query, GL_QUERY_RESULT, &ns);
+   stats_record(RAWSTATS_GPU_READBACK, ns);
+}
+
+static void
+release_pbo(struct pbo *pbo)
+{
+   if (pbo->fence)
+      glDeleteSync(pbo->fence);
+
+   if (pbo->query)
+      glDeleteQueries(1, &pbo->query);
+
+   // Deleting also unmaps
+   if (pbo->obj)
+      glDeleteBuffers(1, &pbo->obj);
+
+   *pbo = (struct pbo){0};
+}
+
+static struct pbo*
+oldest_pending_pbo(struct gl *gl)
+{
+   struct pbo *oldest = NULL;
+   for (size_t i = 0; i < gl->count; ++i) {
+      if (gl->pbo[i].fence && (!oldest || gl->pbo[i].seq < oldest->seq))
+         oldest = &gl->pbo[i];
+   }
+   return oldest;
+}
+
+// Submits a persistent readback once the GPU is done with it, false if it still wasn't after timeout
+static bool
+collect_pbo(struct pbo *pbo, const GLuint64 timeout)
+{
+   const GLenum ret = glClientWaitSync(pbo->fence, (timeout ? GL_SYNC_FLUSH_COMMANDS_BIT : 0), timeout);
+
+   if (ret == GL_TIMEOUT_EXPIRED)
+      return false;
+
+   glDeleteSync(pbo->fence);
+   pbo->fence = NULL;
+
+   if (ret != GL_WAIT_FAILED) {
+      collect_gpu_timer(pbo);
+      submit_pbo(pbo, pbo->map);
+   }
+
+   return true;
+}
+
+static void
+collect_pbos(struct gl *gl)
+{
+   // Submit finished readbacks in order, without ever waiting for the GPU
+   for (struct pbo *oldest; (oldest = oldest_pending_pbo(gl)) && collect_pbo(oldest, 0););
+}
+
+static struct pbo*
+acquire_pbo(struct gl *gl, const size_t size)
+{
+   if (!OPENGL_BUFFER_STORAGE) {
+      struct pbo *pbo = &gl->pbo[gl->active];
+
+      if (!is_buffer(pbo->obj)) {
+         WARNX("create pbo %u", gl->active);
+         glGenBuffers(1, &pbo->obj);
+      }
+
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo->obj);
+      glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+      pbo->size = size;
+      return pbo;
+   }
+
+   PROFILE(collect_pbos(gl), 2.0, RAWSTATS_COLLECT);
+
+   struct pbo *pbo = NULL;
+   for (size_t i = 0; !pbo && i < gl->count; ++i) {
+      if (!gl->pbo[i].fence)
+         pbo = &gl->pbo[i];
+   }
+
+   // GPU is lagging more than we have buffers for, grow the ring
+   if (!pbo) {
+      if (gl->count >= MAX_PBOS)
+         return NULL;
+
+      pbo = &gl->pbo[gl->count++];
+      WARNX("persistent pbo ring grown to %u", gl->count);
+   }
+
+   // Storage is immutable, but smaller frames fit to the buffer we have, so only growing or a much smaller
+   // resolution needs a new buffer
+   if (pbo->obj && (pbo->size < size || pbo->size / 2 > size))
+      release_pbo(pbo);
+
+   if (pbo->obj) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo->obj);
+      return pbo;
+   }
+
+   const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+   glGenBuffers(1, &pbo->obj);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo->obj);
+   glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags | GL_CLIENT_STORAGE_BIT);
+
+   if (!(pbo->map = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags))) {
+      WARNX("failed to map persistent pbo (%zu)", size);
+      release_pbo(pbo);
+      return NULL;
+   }
+
+   pbo->size = size;
+   return pbo;
+}
+
+static void
+resize_pbos(struct gl *gl)
+{
+   // Pending readbacks is how many frames behind the GPU is, keep one spare buffer on top of the worst we've seen
+   uint8_t pending = 0;
+   for (size_t i = 0; i < gl->count; ++i)
+      pending += (gl->pbo[i].fence != NULL);
+
+   gl->max_pending = (pending > gl->max_pending ? pending : gl->max_pending);
+
+   if (++gl->since_shrink < PBO_SHRINK_FRAMES)
+      return;
+
+   if (gl->max_pending + 1 < gl->count && !gl->pbo[gl->count - 1].fence) {
+      release_pbo(&gl->pbo[--gl->count]);
+      WARNX("persistent pbo ring shrunk to %u", gl->count);
+   }
+
+   gl->since_shrink = gl->max_pending = 0;
+}
+
+static void
+capture_frame_pbo(struct gl *gl, const GLint view[8], const uint64_t ts)
+{
+   const struct capture_rect rect = get_capture_rect(view);
+
+   if (!rect.width || !rect.height)
+      return;
+
+   // ES can only read RGBA, we drop the A component while copying out of the PBO
+   // to save pipe bandwidth. RGB also is unaligned, but seem just as fast as RGBA on Nvidia.
+   struct readback readback = {
+      .video = "rgb",
+      .format = (OPENGL_VARIANT == OPENGL_ES ? GL_RGBA : GL_RGB),
+      .x = rect.x,
+      .y = rect.y,
+      .width = rect.width,
+      .height = rect.height,
+      .video_width = rect.width,
+      .video_height = rect.height,
+      .components = (OPENGL_VARIANT == OPENGL_ES ? 4 : 3),
+      .out_components = 3,
+      .flip = rect.flip,
+   };
+
+   struct { GLenum t; enum shadow_field f; GLint o; GLint v; } map[] = {
+      { .t = GL_PACK_ALIGNMENT, .f = SHADOW_PACK_ALIGNMENT, .v = 1 },
+      { .t = GL_PACK_ROW_LENGTH, .f = SHADOW_PACK_ROW_LENGTH },
+      { .t = GL_PACK_IMAGE_HEIGHT, .f = SHADOW_PACK_IMAGE_HEIGHT },
+      { .t = GL_PACK_SKIP_PIXELS, .f = SHADOW_PACK_SKIP_PIXELS },
+   };
+
+   PROFILE(
+   struct gl_state state;
+   const bool convert = ((GPU_YUV || is_scaled(&rect)) && !gl->convert.failed && has_gpu_convert());
+
+   if (!convert && is_scaled(&rect))
+      WARN_ONCE("can't scale without OpenGL 3.0 or OpenGL ES 3.0, capturing at game resolution");
+
+   if (convert) {
+      save_gl_state(&state);
+
+      if (!blit_frame(&gl->convert, &state, &rect) ||
+          !(GPU_YUV ? convert_yuv420p(&gl->convert, &readback) : read_blitted(&gl->convert, &readback))) {
+         WARNX("gpu conversion failed, falling back to unscaled rgb");
+         gl->convert.failed = true;
+         convert_release(&gl->convert);
+         glBindFramebuffer(GL_READ_FRAMEBUFFER, state.read_fbo);
+      }
+   }
+
+   struct pbo *pbo;
+   if ((pbo = acquire_pbo(gl, readback.width * readback.height * readback.components))) {
+      for (size_t i = 0; i < ARRAY_SIZE(map); ++i) {
+         if ((map[i].o = shadow_integer(map[i].f, map[i].t)) != map[i].v)
+            glPixelStorei(map[i].t, map[i].v);
+      }
+
+      const bool timed = begin_gpu_timer(pbo);
+      glReadPixels(readback.x, readback.y, readback.width, readback.height, readback.format, GL_UNSIGNED_BYTE, NULL);
+
+      if (timed)
+         glEndQuery(GL_TIME_ELAPSED);
+
+      for (size_t i = 0; i < ARRAY_SIZE(map); ++i) {
+         if (map[i].o != map[i].v)
+            glPixelStorei(map[i].t, map[i].o);
+      }
+
+      pbo->ts = ts;
+      pbo->readback = readback;
+      pbo->written = (glGetError() == GL_NO_ERROR);
+
+      if (OPENGL_BUFFER_STORAGE && pbo->written) {
+         pbo->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+         pbo->seq = gl->seq++;
+      }
+
+      glFlush();
+   } else {
+      stats_count(RAWSTATS_FRAMES_MISSED, 1);
+
+      if (SHOW_FRAME_DROPS)
+         WARNX("WARNING: dropping frame (all %u pbos are still pending)", MAX_PBOS);
+   }
+
+   if (convert)
+      restore_gl_state(&state);
+   , 1.0, RAWSTATS_READBACK);
+
+   if (OPENGL_BUFFER_STORAGE) {
+      resize_pbos(gl);
+      return;
+   }
+
+   gl->active = (gl->active + 1) % NUM_PBOS;
+
+   if (is_buffer(gl->pbo[gl->active].obj) && gl->pbo[gl->active].written) {
+      void *buf;
 
       PROFILE(
       glBindBuffer(GL_PIXEL_PACK_BUFFER, gl->pbo[gl->active].obj);
-      buf = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
-      , 2.0, "map_buffer");
+      buf = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, gl->pbo[gl->active].size, GL_MAP_READ_BIT);
+      , 2.0, RAWSTATS_MAP);
 
       if (buf) {
-         PROFILE(
-         flip_pixels_if_needed(view, buf, info.video.width, info.video.height, frame.components);
-         write_data(&info, buf, size);
+         collect_gpu_timer(&gl->pbo[gl->active]);
+         submit_pbo(&gl->pbo[gl->active], buf);
          glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
          gl->pbo[gl->active].written = false;
-         , 2.0, "write_frame");
       }
    }
 }
 
+static void
+discard_capture(struct gl *gl)
+{
+   // Readbacks still in flight belong to a reader that's gone
+   for (size_t i = 0; i < MAX_PBOS; ++i) {
+      if (gl->pbo[i].fence)
+         glDeleteSync(gl->pbo[i].fence);
+
+      gl->pbo[i].fence = NULL;
+      gl->pbo[i].written = gl->pbo[i].timed = false;
+   }
+
+   // New reader gets a new timeline
+   gl->epoch = 0;
+}
+
 static void
 reset_capture(struct gl *gl)
 {
-   for (size_t i = 0; i < NUM_PBOS; ++i) {
+   for (size_t i = 0; i < MAX_PBOS; ++i) {
+      if (gl->pbo[i].fence)
+         glDeleteSync(gl->pbo[i].fence);
+
       if (is_buffer(gl->pbo[i].obj))
          glDeleteBuffers(1, &gl->pbo[i].obj);
+
+      if (gl->pbo[i].query)
+         glDeleteQueries(1, &gl->pbo[i].query);
    }
 
+   if (has_gpu_convert())
+      convert_release(&gl->convert);
+
    WARNX("capture reset");
    *gl = (struct gl){0};
 }
 
 static void
-capture_frame(struct gl *gl, const uint64_t ts, const uint32_t fps, const GLint view[8])
+capture_frame(struct gl *gl, uint64_t ts, const GLint view[8])
 {
-   static __thread uint64_t last_time;
-   const uint64_t target_rate = (1e9 / (TARGET_FPS * 2));
-   const uint64_t current_rate = (1e9 / fps);
-   const uint64_t rate = target_rate - current_rate;
+   if (DROP_FRAMES && !gl->epoch) {
+      gl->epoch = ts;
+      gl->slot = 0;
+   } else if (DROP_FRAMES) {
+      const uint64_t slot = timeline_slot(gl->epoch, ts);
+
+      // Decided before anything touches the GPU, so dropped frames cost no readback
+      if (slot <= gl->slot) {
+         stats_count(RAWSTATS_FRAMES_DROPPED, 1);
+
+         if (SHOW_FRAME_DROPS)
+            WARNX("WARNING: dropping frame (slot %llu already has one)", (unsigned long long)slot);
+         return;
+      }
 
-   if (DROP_FRAMES && last_time > 0 && target_rate > current_rate && ts - last_time <= rate) {
-      if (SHOW_FRAME_DROPS)
-         WARNX("WARNING: dropping frame (%.2f <= %.2f)", (ts - last_time) / 1e6, rate / 1e6);
-      return;
-   }
+      if (SHOW_FRAME_DROPS && slot > gl->slot + 1)
+         WARNX("WARNING: %llu slots without a frame", (unsigned long long)(slot - gl->slot - 1));
 
-   last_time = ts;
+      gl->slot = slot;
+      ts = timeline_time(gl->epoch, slot);
+   }
 
-   GLint pbo;
-   glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pbo);
+   const GLint pbo = shadow_integer(SHADOW_PACK_BUFFER, GL_PIXEL_PACK_BUFFER_BINDING);
    capture_frame_pbo(gl, view, ts);
    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
 }
 
+// LOCKSTEP: waits until the video queue has room for every readback in flight plus the one of this swap, so none
+// of them get dropped. Persistent readbacks get finished early if the queue has room but they don't fit
+static void
+lockstep_wait_for_mux(struct gl *gl, const uint32_t session)
+{
+   const struct queue *queue = &MUX.queue[STREAM_VIDEO];
+
+   while (mux_session() == session) {
+      uint32_t pending = 0;
+      for (size_t i = 0; i < MAX_PBOS; ++i)
+         pending += (OPENGL_BUFFER_STORAGE ? gl->pbo[i].fence != NULL : gl->pbo[i].written);
+
+      const uint32_t queued = queue->head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+      if (queued + pending < queue->size)
+         return;
+
+      struct pbo *oldest;
+      if (OPENGL_BUFFER_STORAGE && queued < queue->size && (oldest = oldest_pending_pbo(gl))) {
+         collect_pbo(oldest, 1e9);
+         continue;
+      }
+
+      // Nothing left to wait for
+      if (!queued)
+         return;
+
+      // Mux doesn't signal producers, but this is the offline mode, polling a ms at a time costs nothing
+      nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+   }
+}
+
 static void
 draw_indicator(const GLint view[8])
 {
    GLfloat clear[4];
-   GLboolean scissor;
-   glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
-   glGetBooleanv(GL_SCISSOR_TEST, &scissor);
+   shadow_clear_color(clear);
+   const bool scissor = shadow_enabled(GL_SCISSOR_TEST);
 
    if (!scissor)
       glEnable(GL_SCISSOR_TEST);
@@ -521,42 +2757,68 @@ static void
 swap_buffers(void)
 {
    static __thread uint64_t last_time, fps_time;
-   const uint64_t ts = get_time_ns();
-   const uint32_t fps = (last_time > 0 ? 1.0 / ((ts - last_time) / 1e9) : TARGET_FPS);
-   last_time = ts;
+   const uint64_t now = get_time_ns();
+   const uint32_t fps = (last_time > 0 ? 1.0 / ((now - last_time) / 1e9) : TARGET_FPS);
+   last_time = now;
 
-   if ((ts - fps_time) / 1e9 > 5.0) {
+   if ((now - fps_time) / 1e9 > 5.0) {
       WARNX("FPS: %u", fps);
-      fps_time = ts;
+      fps_time = now;
    }
 
+   // Lockstep frame is stamped with the virtual clock, which moves on once the frame is captured
+   const uint64_t ts = (LOCKSTEP ? lockstep_time_ns() : now);
+
+   if (LOCKSTEP)
+      __atomic_store_n(&LOCKSTEP_CLOCK.swapping, true, __ATOMIC_RELAXED);
+
    void* (*procs[])(const char*) = {
       (void*)_eglGetProcAddress,
       (void*)_glXGetProcAddressARB,
       (void*)_glXGetProcAddress
    };
 
+   // Idle until someone reads the stream
+   const uint32_t session = mux_session();
+
+   if (!session) {
+      if (LOCKSTEP)
+         lockstep_advance();
+      return;
+   }
+
    load_gl_function_pointers(procs, ARRAY_SIZE(procs));
    while (glGetError() != GL_NO_ERROR);
 
    PROFILE(
    static __thread struct gl gl;
-   GLint view[ARRAY_SIZE(LAST_FRAMEBUFFER_BLIT)];
+   GLint view[ARRAY_SIZE(LAST_FRAMEBUFFER_BLIT)] = {0};
+
+   if (gl.session != session) {
+      discard_capture(&gl);
+      gl.session = session;
+   }
 
    if (LAST_FRAMEBUFFER_BLIT[2] == 0 || LAST_FRAMEBUFFER_BLIT[3] == 0) {
-      glGetIntegerv(GL_VIEWPORT, view);
+      shadow_viewport(view);
    } else {
       memcpy(view, LAST_FRAMEBUFFER_BLIT, sizeof(view));
    }
 
-   PROFILE(capture_frame(&gl, ts, fps, view), 2.0, "capture_frame");
-   PROFILE(draw_indicator(view), 1.0, "draw_indicator");
+   if (LOCKSTEP)
+      PROFILE(lockstep_wait_for_mux(&gl, session), 2.0, RAWSTATS_LOCKSTEP_WAIT);
+
+   PROFILE(capture_frame(&gl, ts, view), 2.0, RAWSTATS_CAPTURE);
+   PROFILE(draw_indicator(view), 1.0, RAWSTATS_INDICATOR);
 
    if (glGetError() != GL_NO_ERROR) {
       WARNX("glError occured");
       reset_capture(&gl);
    }
-   , 2.0, "swap_buffers");
+   , 2.0, RAWSTATS_SWAP);
+
+   if (LOCKSTEP)
+      lockstep_advance();
 }
 
 static const char*
@@ -590,39 +2852,418 @@ alsa_get_format(const snd_pcm_format_t format)
    return NULL;
 }
 
-static bool
-alsa_get_frame_info(snd_pcm_t *pcm, struct frame_info *out_info, const char *caller)
+// Stream info of the configured pcms, so the write hooks don't have to query hw_params every time
+// Filled by the snd_pcm_hw_params and snd_pcm_prepare hooks, dropped by snd_pcm_close
+// Readers keep per thread copies and only take the lock when generation says the pcms changed since
+static struct {
+   pthread_mutex_t lock;
+   uint32_t generation; // bumped with the lock held whenever an entry (other than its lockstep clock) changes
+   struct alsa_pcm {
+      snd_pcm_t *pcm;
+      const char *format_name;
+      snd_pcm_format_t format;
+      uint32_t rate, channels;
+      enum stream stream; // audio track of the pcm, STREAM_LAST until its first write or if all were taken
+      bool played; // tracks are only announced once something was written to them
+      uint64_t lockstep_start, lockstep_frames; // LOCKSTEP clock time of the first sample written since, and samples since
+   } pcm[16];
+} ALSA_PCMS = { .lock = PTHREAD_MUTEX_INITIALIZER, .generation = 1 };
+
+// Entry of the pcm this thread last wrote to, valid while its generation is current
+static __thread struct {
+   uint32_t generation;
+   struct alsa_pcm entry;
+} ALSA_PCM_CACHE;
+
+// Call with the lock held
+static void
+alsa_pcms_changed(void)
+{
+   __atomic_store_n(&ALSA_PCMS.generation, ALSA_PCMS.generation + 1, __ATOMIC_RELEASE);
+}
+
+// Lowest track no other pcm is using, call with the lock held
+static enum stream
+alsa_free_track(void)
+{
+   for (enum stream track = STREAM_AUDIO; track < STREAM_LAST; ++track) {
+      bool taken = false;
+      for (size_t i = 0; i < ARRAY_SIZE(ALSA_PCMS.pcm); ++i)
+         taken |= (ALSA_PCMS.pcm[i].pcm && ALSA_PCMS.pcm[i].stream == track);
+
+      if (!taken)
+         return track;
+   }
+
+   return STREAM_LAST;
+}
+
+// Only playback pcms are kept, their track is picked on the first write (see alsa_lookup_pcm)
+static void
+alsa_store_pcm(snd_pcm_t *pcm, const snd_pcm_hw_params_t *params)
 {
+   if (snd_pcm_stream(pcm) != SND_PCM_STREAM_PLAYBACK)
+      return;
+
    snd_pcm_format_t format;
    unsigned int channels, rate;
-   snd_pcm_hw_params_t *params = alloca(snd_pcm_hw_params_sizeof());
-   snd_pcm_hw_params_current(pcm, params);
    snd_pcm_hw_params_get_format(params, &format);
    snd_pcm_hw_params_get_channels(params, &channels);
    snd_pcm_hw_params_get_rate(params, &rate, NULL);
-   WARN_ONCE("%s (%s:%u:%u)", caller, snd_pcm_format_name(format), rate, channels);
+
+   struct alsa_pcm entry = {
+      .pcm = pcm,
+      .format_name = alsa_get_format(format),
+      .format = format,
+      .rate = rate,
+      .channels = channels,
+      .stream = STREAM_LAST,
+   };
+
+   pthread_mutex_lock(&ALSA_PCMS.lock);
+   struct alsa_pcm *slot = NULL;
+   for (size_t i = 0; i < ARRAY_SIZE(ALSA_PCMS.pcm); ++i) {
+      if (ALSA_PCMS.pcm[i].pcm == pcm) {
+         slot = &ALSA_PCMS.pcm[i];
+         break;
+      }
+
+      if (!slot && !ALSA_PCMS.pcm[i].pcm)
+         slot = &ALSA_PCMS.pcm[i];
+   }
+
+   // Reconfigured pcm keeps its track
+   if (slot) {
+      entry.stream = (slot->pcm ? slot->stream : STREAM_LAST);
+      entry.played = (slot->pcm && slot->played);
+      *slot = entry;
+      alsa_pcms_changed();
+   }
+   pthread_mutex_unlock(&ALSA_PCMS.lock);
+
+   if (!slot)
+      WARN_ONCE("too many open pcms, not capturing the rest");
+}
+
+static void
+alsa_configure(snd_pcm_t *pcm, const snd_pcm_hw_params_t *params)
+{
+   if (!params) {
+      snd_pcm_hw_params_t *current = alloca(snd_pcm_hw_params_sizeof());
+      if (snd_pcm_hw_params_current(pcm, current) < 0)
+         return;
+      params = current;
+   }
+
+   alsa_store_pcm(pcm, params);
+}
+
+static void
+alsa_close(snd_pcm_t *pcm)
+{
+   pthread_mutex_lock(&ALSA_PCMS.lock);
+   for (size_t i = 0; i < ARRAY_SIZE(ALSA_PCMS.pcm); ++i) {
+      if (ALSA_PCMS.pcm[i].pcm == pcm)
+         ALSA_PCMS.pcm[i] = (struct alsa_pcm){0};
+   }
+   alsa_pcms_changed();
+   pthread_mutex_unlock(&ALSA_PCMS.lock);
+}
+
+// Entry of a pcm that is being written to, false if it isn't known
+// First write gives the pcm its track, so pcms that are only opened to probe them don't take one
+static bool
+alsa_lookup_pcm(snd_pcm_t *pcm, struct alsa_pcm *out_entry)
+{
+   bool found = false;
+   pthread_mutex_lock(&ALSA_PCMS.lock);
+   for (size_t i = 0; i < ARRAY_SIZE(ALSA_PCMS.pcm); ++i) {
+      struct alsa_pcm *entry = &ALSA_PCMS.pcm[i];
+      if (entry->pcm != pcm)
+         continue;
+
+      // Track is announced on the first write, the mux has to see it. One that didn't get a track tries again
+      // after other pcms changed (e.g. one got closed)
+      const enum stream stream = (entry->stream == STREAM_LAST ? alsa_free_track() : entry->stream);
+      if (!entry->played || entry->stream != stream) {
+         entry->played = true;
+         entry->stream = stream;
+         alsa_pcms_changed();
+      }
+
+      *out_entry = *entry;
+      ALSA_PCM_CACHE.entry = *entry;
+      ALSA_PCM_CACHE.generation = ALSA_PCMS.generation;
+      found = true;
+      break;
+   }
+   pthread_mutex_unlock(&ALSA_PCMS.lock);
+
+   if (found && out_entry->stream == STREAM_LAST)
+      WARN_ONCE("more than %u pcms playing at once, not capturing the rest (increase AUDIO_TRACKS)", AUDIO_TRACKS);
+
+   return found;
+}
+
+static bool
+alsa_get_frame_info(snd_pcm_t *pcm, struct frame_info *out_info, snd_pcm_format_t *out_format, const char *caller)
+{
+   struct alsa_pcm entry = {0};
+   if (ALSA_PCM_CACHE.entry.pcm == pcm && ALSA_PCM_CACHE.generation == __atomic_load_n(&ALSA_PCMS.generation, __ATOMIC_ACQUIRE)) {
+      entry = ALSA_PCM_CACHE.entry;
+   } else if (!alsa_lookup_pcm(pcm, &entry)) {
+      // Configured before we could see it, e.g. through a plugin's internal calls
+      // Not configured at all (or a plugin that can't tell) isn't cached, or it would stick until snd_pcm_close
+      // Capture pcms are never stored, so their mmap commits end here too
+      snd_pcm_hw_params_t *params = alloca(snd_pcm_hw_params_sizeof());
+      if (snd_pcm_hw_params_current(pcm, params) < 0)
+         return false;
+
+      alsa_store_pcm(pcm, params);
+      if (!alsa_lookup_pcm(pcm, &entry))
+         return false;
+   }
+
+   WARN_ONCE("%s (%s:%u:%u)", caller, snd_pcm_format_name(entry.format), entry.rate, entry.channels);
    out_info->ts = get_time_ns();
-   out_info->stream = STREAM_AUDIO;
-   out_info->format = alsa_get_format(format);
-   out_info->audio.rate = rate;
-   out_info->audio.channels = channels;
-   return (out_info->format != NULL);
+   out_info->stream = entry.stream;
+   out_info->format = entry.format_name;
+   out_info->audio.rate = entry.rate;
+   out_info->audio.channels = entry.channels;
+   *out_format = entry.format;
+   return (out_info->format != NULL && entry.stream != STREAM_LAST);
+}
+
+// LOCKSTEP: stamps the write with where its samples fall on the virtual clock, and holds the writer back while it's
+// too far ahead of the clock. Samples follow each other back to back until the writer falls behind the clock
+static void
+alsa_lockstep(snd_pcm_t *pcm, struct frame_info *info, const snd_pcm_uframes_t frames)
+{
+   const uint64_t now = lockstep_time_ns();
+   uint64_t end = now;
+
+   pthread_mutex_lock(&ALSA_PCMS.lock);
+   for (size_t i = 0; i < ARRAY_SIZE(ALSA_PCMS.pcm); ++i) {
+      struct alsa_pcm *entry = &ALSA_PCMS.pcm[i];
+      if (entry->pcm != pcm || !entry->rate)
+         continue;
+
+      const uint64_t at = entry->lockstep_start + entry->lockstep_frames * (uint64_t)1e9 / entry->rate;
+      if (!entry->lockstep_start || at < now) {
+         // First write, or an underrun (e.g. pause), continue from now
+         entry->lockstep_start = now;
+         entry->lockstep_frames = 0;
+      }
+
+      info->ts = entry->lockstep_start + entry->lockstep_frames * (uint64_t)1e9 / entry->rate;
+      entry->lockstep_frames += frames;
+      end = entry->lockstep_start + entry->lockstep_frames * (uint64_t)1e9 / entry->rate;
+      break;
+   }
+   pthread_mutex_unlock(&ALSA_PCMS.lock);
+
+   const uint64_t ahead = LOCKSTEP_AUDIO_AHEAD_MS * (uint64_t)1e6;
+   if (end > now + ahead)
+      lockstep_wait_until(end - ahead);
+}
+
+// False if no pcm is playing on the track, otherwise fills out_info (if given) with what it plays
+static bool
+audio_track_info(const enum stream stream, struct frame_info *out_info)
+{
+   // Mux asks about every track on every round, the pcms only need another look once they changed
+   static __thread struct {
+      uint32_t generation;
+      bool found[STREAM_LAST];
+      struct frame_info info[STREAM_LAST];
+   } tracks;
+
+   if (tracks.generation != __atomic_load_n(&ALSA_PCMS.generation, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&ALSA_PCMS.lock);
+      memset(tracks.found, 0, sizeof(tracks.found));
+      for (size_t i = 0; i < ARRAY_SIZE(ALSA_PCMS.pcm); ++i) {
+         const struct alsa_pcm *entry = &ALSA_PCMS.pcm[i];
+         if (!entry->pcm || !entry->played || entry->stream == STREAM_LAST || tracks.found[entry->stream] || !entry->format_name)
+            continue;
+
+         tracks.info[entry->stream] = (struct frame_info){
+            .stream = entry->stream,
+            .format = entry->format_name,
+            .audio = { .rate = entry->rate, .channels = entry->channels },
+         };
+         tracks.found[entry->stream] = true;
+      }
+      tracks.generation = ALSA_PCMS.generation;
+      pthread_mutex_unlock(&ALSA_PCMS.lock);
+   }
+
+   if (out_info && tracks.found[stream])
+      *out_info = tracks.info[stream];
+
+   return tracks.found[stream];
 }
 
 static void
 alsa_writei(snd_pcm_t *pcm, const void *buffer, const snd_pcm_uframes_t size, const char *caller)
 {
    struct frame_info info;
-   if (alsa_get_frame_info(pcm, &info, caller))
-      PROFILE(write_data(&info, buffer, snd_pcm_frames_to_bytes(pcm, size)), 2.0, "alsa_write");
+   snd_pcm_format_t format;
+   if (ALSA_WRITING || !mux_session() || !alsa_get_frame_info(pcm, &info, &format, caller))
+      return;
+
+   if (LOCKSTEP)
+      alsa_lockstep(pcm, &info, size);
+
+   const size_t bytes = snd_pcm_frames_to_bytes(pcm, size);
+   uint8_t *dst;
+   if ((dst = acquire_audio(&info, bytes))) {
+      PROFILE(
+      memcpy(dst, buffer, bytes);
+      submit_audio(info.stream, size);
+      , 2.0, RAWSTATS_AUDIO);
+   }
+}
+
+static void
+alsa_writen(snd_pcm_t *pcm, void **bufs, const snd_pcm_uframes_t size, const char *caller)
+{
+   struct frame_info info;
+   snd_pcm_format_t format;
+   if (!bufs || ALSA_WRITING || !mux_session() || !alsa_get_frame_info(pcm, &info, &format, caller))
+      return;
+
+   if (LOCKSTEP)
+      alsa_lockstep(pcm, &info, size);
+
+   // Interleave straight into the queued packet, queue reuses its buffers so nothing gets allocated per call
+   // NULL channel buffer means silence for alsa too
+   uint8_t *dst;
+   if ((dst = acquire_audio(&info, snd_pcm_frames_to_bytes(pcm, size)))) {
+      PROFILE(
+      interleave_samples(dst, bufs, info.audio.channels, size, snd_pcm_format_physical_width(format) / 8, snd_pcm_format_silence_64(format));
+      submit_audio(info.stream, size);
+      , 2.0, RAWSTATS_AUDIO);
+   }
+}
+
+// Areas returned by the last snd_pcm_mmap_begin of this thread, commit doesn't pass them again
+static __thread struct {
+   snd_pcm_t *pcm;
+   const snd_pcm_channel_area_t *areas;
+} ALSA_MMAP;
+
+static void
+alsa_mmap_begin(snd_pcm_t *pcm, const snd_pcm_channel_area_t *areas)
+{
+   if (ALSA_WRITING)
+      return;
+
+   ALSA_MMAP.pcm = pcm;
+   ALSA_MMAP.areas = areas;
+}
+
+// Gathers frames starting at offset from the mmap areas to dst as interleaved samples
+static void
+alsa_copy_areas(uint8_t *restrict dst, const snd_pcm_channel_area_t *areas, const snd_pcm_uframes_t offset, const snd_pcm_uframes_t frames, const uint32_t channels, const uint32_t bits)
+{
+   const size_t sample_bytes = bits / 8, frame_bytes = channels * sample_bytes;
+   bool interleaved = (areas[0].first % 8 == 0), planar = true;
+   for (uint32_t c = 0; c < channels; ++c) {
+      interleaved &= (areas[c].addr == areas[0].addr && areas[c].first == areas[0].first + c * bits && areas[c].step == channels * bits);
+      planar &= (areas[c].step == bits && areas[c].first % 8 == 0);
+   }
+
+   // Common case, the region already is what we want
+   if (interleaved) {
+      memcpy(dst, (const uint8_t*)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8, frames * frame_bytes);
+      return;
+   }
+
+   if (planar) {
+      void *src[channels];
+      for (uint32_t c = 0; c < channels; ++c)
+         src[c] = (uint8_t*)areas[c].addr + areas[c].first / 8 + offset * sample_bytes;
+      interleave_samples(dst, src, channels, frames, sample_bytes, 0);
+      return;
+   }
+
+   for (uint32_t c = 0; c < channels; ++c) {
+      uint8_t *d = dst + c * sample_bytes;
+      for (snd_pcm_uframes_t f = offset; f < offset + frames; ++f, d += frame_bytes)
+         memcpy(d, (const uint8_t*)areas[c].addr + (areas[c].first + f * areas[c].step) / 8, sample_bytes);
+   }
+}
+
+static void
+alsa_mmap_commit(snd_pcm_t *pcm, const snd_pcm_uframes_t offset, const snd_pcm_uframes_t frames, const char *caller)
+{
+   if (ALSA_WRITING)
+      return;
+
+   if (ALSA_MMAP.pcm != pcm || !ALSA_MMAP.areas) {
+      WARN_ONCE("%s without snd_pcm_mmap_begin, not capturing it", caller);
+      return;
+   }
+
+   struct frame_info info;
+   snd_pcm_format_t format;
+   if (!mux_session() || !alsa_get_frame_info(pcm, &info, &format, caller))
+      return;
+
+   if (LOCKSTEP)
+      alsa_lockstep(pcm, &info, frames);
+
+   // Committed frames are still in the mmap region after commit, copy them from there straight into the queued packet
+   uint8_t *dst;
+   if ((dst = acquire_audio(&info, snd_pcm_frames_to_bytes(pcm, frames)))) {
+      PROFILE(
+      alsa_copy_areas(dst, ALSA_MMAP.areas, offset, frames, info.audio.channels, snd_pcm_format_physical_width(format));
+      submit_audio(info.stream, frames);
+      , 2.0, RAWSTATS_AUDIO);
+   }
+}
+
+// Wall and monotonic clocks, CPU time clocks (and the negative ids of other processes and threads) run as they are
+static bool
+is_scaled_clock(clockid_t clk_id)
+{
+   const uint32_t scaled = 1 << CLOCK_REALTIME | 1 << CLOCK_MONOTONIC | 1 << CLOCK_MONOTONIC_RAW | 1 << CLOCK_REALTIME_COARSE |
+                           1 << CLOCK_MONOTONIC_COARSE | 1 << CLOCK_BOOTTIME | 1 << CLOCK_REALTIME_ALARM | 1 << CLOCK_BOOTTIME_ALARM | 1 << CLOCK_TAI;
+   return (clk_id >= 0 && clk_id < 32 && (scaled >> clk_id) & 1);
+}
+
+// d * SPEED_HACK, one 64x64 multiply split in four so nothing overflows
+static inline uint64_t
+speed_scale(const uint64_t d)
+{
+   const uint64_t q = SPEED_HACK_Q32, dh = d >> 32, dl = d & 0xffffffff, qh = q >> 32, ql = q & 0xffffffff;
+   return ((dh * qh) << 32) + dh * ql + dl * qh + ((dl * ql) >> 32);
 }
 
+// Scaled time of a clock that passes is_scaled_clock
+// All clocks run on one scaled monotonic timeline shared by every thread, each clock keeps its offset from it
 static uint64_t
 get_fake_time_ns(clockid_t clk_id)
 {
-   static __thread uint64_t base[16];
-   assert((size_t)clk_id < ARRAY_SIZE(base));
-   const uint64_t current = get_time_ns_clock(clk_id);
-   base[clk_id] = (base[clk_id] ? base[clk_id] : current);
-   return base[clk_id] + (current - base[clk_id]) * SPEED_HACK;
+   static uint64_t origin, offset[32] = { [0 ... 31] = UINT64_MAX };
+   assert(is_scaled_clock(clk_id));
+
+   uint64_t start = __atomic_load_n(&origin, __ATOMIC_ACQUIRE);
+   if (!start) {
+      const uint64_t now = get_time_ns();
+      start = (__atomic_compare_exchange_n(&origin, &start, now, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? now : start);
+   }
+
+   uint64_t delta = __atomic_load_n(&offset[clk_id], __ATOMIC_ACQUIRE);
+   if (delta == UINT64_MAX) {
+      const uint64_t clk = get_time_ns_clock(clk_id), now = get_time_ns();
+      const uint64_t mine = (clk_id == CLOCK_MONOTONIC ? 0 : clk - now);
+      delta = (__atomic_compare_exchange_n(&offset[clk_id], &delta, mine, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? mine : delta);
+   }
+
+   // Lockstep clock is on the monotonic timeline already
+   if (LOCKSTEP)
+      return lockstep_time_ns() + delta;
+
+   return start + speed_scale(get_time_ns() - start) + delta;
 }
@@ -0,0 +1,96 @@
+#pragma once
+
+/**
+ * Shadow of the GL state that capturing has to save and restore.
+ *
+ * Hooks in hooks.h update it whenever the program changes the state, so swap_buffers doesn't need
+ * to ask the driver, which on many drivers is a synchronous round trip that stalls the pipeline.
+ * Our own state changes go through the real function pointers and are always undone, so they never show up here.
+ *
+ * State that changes behind the hooks' back (glPopAttrib, glPopClientAttrib, display lists) invalidates the whole shadow.
+ *
+ * Everything is per thread, because GL contexts are. Making a context current invalidates the whole shadow,
+ * and fields that aren't valid get queried from the driver once (see shadow_* getters in glcapture.c).
+ */
+
+enum shadow_field {
+   SHADOW_PACK_BUFFER,
+   SHADOW_UNPACK_BUFFER,
+   SHADOW_PACK_ALIGNMENT,
+   SHADOW_PACK_ROW_LENGTH,
+   SHADOW_PACK_IMAGE_HEIGHT,
+   SHADOW_PACK_SKIP_PIXELS,
+   SHADOW_PROGRAM,
+   SHADOW_VAO,
+   SHADOW_ACTIVE_TEXTURE,
+   SHADOW_TEXTURE, // GL_TEXTURE_2D of GL_TEXTURE0
+   SHADOW_SAMPLER, // of GL_TEXTURE0
+   SHADOW_DRAW_FBO,
+   SHADOW_READ_FBO,
+   SHADOW_VIEWPORT,
+   SHADOW_CLEAR_COLOR,
+   SHADOW_COLOR_MASK,
+   SHADOW_TIME_QUERY, // program's active GL_TIME_ELAPSED query
+   SHADOW_LAST,
+};
+
+// Capabilities that affect blitting or drawing to our targets
+static const GLenum SHADOW_CAPS[] = {
+   GL_BLEND, GL_DEPTH_TEST, GL_STENCIL_TEST, GL_SCISSOR_TEST, GL_CULL_FACE, GL_DITHER,
+   GL_RASTERIZER_DISCARD, GL_SAMPLE_ALPHA_TO_COVERAGE,
+   // Desktop only
+   GL_FRAMEBUFFER_SRGB, GL_COLOR_LOGIC_OP,
+};
+
+struct gl_shadow {
+   GLint value[SHADOW_LAST]; // scalar fields
+   GLint viewport[4];
+   GLfloat clear_color[4];
+   GLboolean color_mask[4];
+   uint32_t valid; // 1 << shadow_field
+   uint32_t caps, caps_valid; // 1 << index to SHADOW_CAPS
+};
+
+static __thread struct gl_shadow GL_SHADOW;
+
+static void
+shadow_set(const enum shadow_field field, const GLint value)
+{
+   GL_SHADOW.value[field] = value;
+   GL_SHADOW.valid |= (1 << field);
+}
+
+static void
+shadow_invalidate(const enum shadow_field field)
+{
+   GL_SHADOW.valid &= ~(1 << field);
+}
+
+static void
+shadow_invalidate_all(void)
+{
+   GL_SHADOW.valid = GL_SHADOW.caps_valid = 0;
+}
+
+static void
+shadow_delete(const enum shadow_field field, const GLsizei n, const GLuint *objs)
+{
+   // Deleting bound object reverts the binding to zero
+   for (GLsizei i = 0; objs && i < n; ++i) {
+      if (objs[i] && (GL_SHADOW.valid & (1 << field)) && GL_SHADOW.value[field] == (GLint)objs[i])
+         GL_SHADOW.value[field] = 0;
+   }
+}
+
+static void
+shadow_cap(const GLenum cap, const bool enabled)
+{
+   for (size_t i = 0; i < ARRAY_SIZE(SHADOW_CAPS); ++i) {
+      if (SHADOW_CAPS[i] != cap)
+         continue;
+
+      GL_SHADOW.caps = (enabled ? GL_SHADOW.caps | (1 << i) : GL_SHADOW.caps & ~(1 << i));
+      GL_SHADOW.caps_valid |= (1 << i);
+      return;
+   }
+}
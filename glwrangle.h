@@ -8,19 +8,47 @@ static void (*_glGetBooleanv)(GLenum, GLboolean*);
 static const char* (*_glGetString)(GLenum);
 static GLboolean (*_glIsBuffer)(GLuint);
 static void (*_glGenBuffers)(GLsizei, GLuint*);
-static void (*_glDeleteBuffers)(GLsizei, GLuint*);
-static void (*_glBindBuffer)(GLenum, GLuint);
 static void (*_glBufferData)(GLenum, GLsizeiptr, const GLvoid*, GLenum);
 static void* (*_glMapBufferRange)(GLenum, GLintptr, GLsizeiptr, GLbitfield);
 static void (*_glUnmapBuffer)(GLenum);
-static void (*_glPixelStorei)(GLenum, GLint);
 static void (*_glReadPixels)(GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, GLvoid*);
-static void (*_glEnable)(GLenum);
-static void (*_glDisable)(GLenum);
 static void (*_glScissor)(GLint, GLint, GLsizei, GLsizei);
-static void (*_glClearColor)(GLclampf, GLclampf, GLclampf, GLclampf);
 static void (*_glClear)(GLbitfield);
 static void (*_glDebugMessageCallback)(GLDEBUGPROC, const void*);
+static void (*_glGenFramebuffers)(GLsizei, GLuint*);
+static void (*_glFramebufferTexture2D)(GLenum, GLenum, GLenum, GLuint, GLint);
+static GLenum (*_glCheckFramebufferStatus)(GLenum);
+static void (*_glGenTextures)(GLsizei, GLuint*);
+static void (*_glTexImage2D)(GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid*);
+static void (*_glTexParameteri)(GLenum, GLenum, GLint);
+static GLuint (*_glCreateShader)(GLenum);
+static void (*_glShaderSource)(GLuint, GLsizei, const GLchar**, const GLint*);
+static void (*_glCompileShader)(GLuint);
+static void (*_glGetShaderiv)(GLuint, GLenum, GLint*);
+static void (*_glGetShaderInfoLog)(GLuint, GLsizei, GLsizei*, GLchar*);
+static void (*_glDeleteShader)(GLuint);
+static GLuint (*_glCreateProgram)(void);
+static void (*_glAttachShader)(GLuint, GLuint);
+static void (*_glLinkProgram)(GLuint);
+static void (*_glGetProgramiv)(GLuint, GLenum, GLint*);
+static void (*_glGetProgramInfoLog)(GLuint, GLsizei, GLsizei*, GLchar*);
+static void (*_glDeleteProgram)(GLuint);
+static GLint (*_glGetUniformLocation)(GLuint, const GLchar*);
+static void (*_glUniform1i)(GLint, GLint);
+static void (*_glUniform2i)(GLint, GLint, GLint);
+static void (*_glGenVertexArrays)(GLsizei, GLuint*);
+static const GLubyte* (*_glGetStringi)(GLenum, GLuint);
+static void (*_glBufferStorage)(GLenum, GLsizeiptr, const void*, GLbitfield);
+static GLsync (*_glFenceSync)(GLenum, GLbitfield);
+static GLenum (*_glClientWaitSync)(GLsync, GLbitfield, GLuint64);
+static void (*_glDeleteSync)(GLsync);
+static void (*_glDrawArrays)(GLenum, GLint, GLsizei);
+static GLboolean (*_glIsEnabled)(GLenum);
+static void (*_glGenQueries)(GLsizei, GLuint*);
+static void (*_glDeleteQueries)(GLsizei, const GLuint*);
+static void (*_glGetQueryiv)(GLenum, GLenum, GLint*);
+static void (*_glGetQueryObjectiv)(GLuint, GLenum, GLint*);
+static void (*_glGetQueryObjectui64v)(GLuint, GLenum, GLuint64*);
 
 enum gl_variant {
    OPENGL_ES,
@@ -34,6 +62,12 @@ struct gl_version {
 static enum gl_variant OPENGL_VARIANT;
 static struct gl_version OPENGL_VERSION;
 
+// ARB_buffer_storage / EXT_buffer_storage and sync objects for persistently mapped PBOs
+static bool OPENGL_BUFFER_STORAGE;
+
+// ARB_timer_query / EXT_disjoint_timer_query for timing the readback on the GPU
+static bool OPENGL_TIMER_QUERY;
+
 #define glFlush _glFlush
 #define glGetError _glGetError
 #define glGetIntegerv _glGetIntegerv
@@ -55,6 +89,54 @@ static struct gl_version OPENGL_VERSION;
 #define glClearColor _glClearColor
 #define glClear _glClear
 #define glDebugMessageCallback _glDebugMessageCallback
+#define glGenFramebuffers _glGenFramebuffers
+#define glDeleteFramebuffers _glDeleteFramebuffers
+#define glBindFramebuffer _glBindFramebuffer
+#define glFramebufferTexture2D _glFramebufferTexture2D
+#define glCheckFramebufferStatus _glCheckFramebufferStatus
+#define glGenTextures _glGenTextures
+#define glDeleteTextures _glDeleteTextures
+#define glBindTexture _glBindTexture
+#define glActiveTexture _glActiveTexture
+#define glTexImage2D _glTexImage2D
+#define glTexParameteri _glTexParameteri
+#define glCreateShader _glCreateShader
+#define glShaderSource _glShaderSource
+#define glCompileShader _glCompileShader
+#define glGetShaderiv _glGetShaderiv
+#define glGetShaderInfoLog _glGetShaderInfoLog
+#define glDeleteShader _glDeleteShader
+#define glCreateProgram _glCreateProgram
+#define glAttachShader _glAttachShader
+#define glLinkProgram _glLinkProgram
+#define glGetProgramiv _glGetProgramiv
+#define glGetProgramInfoLog _glGetProgramInfoLog
+#define glDeleteProgram _glDeleteProgram
+#define glUseProgram _glUseProgram
+#define glGetUniformLocation _glGetUniformLocation
+#define glUniform1i _glUniform1i
+#define glUniform2i _glUniform2i
+#define glGenVertexArrays _glGenVertexArrays
+#define glDeleteVertexArrays _glDeleteVertexArrays
+#define glBindVertexArray _glBindVertexArray
+#define glBindSampler _glBindSampler
+#define glGetStringi _glGetStringi
+#define glBufferStorage _glBufferStorage
+#define glFenceSync _glFenceSync
+#define glClientWaitSync _glClientWaitSync
+#define glDeleteSync _glDeleteSync
+#define glDrawArrays _glDrawArrays
+#define glViewport _glViewport
+#define glColorMask _glColorMask
+#define glIsEnabled _glIsEnabled
+#define glBlitFramebuffer _glBlitFramebuffer
+#define glGenQueries _glGenQueries
+#define glDeleteQueries _glDeleteQueries
+#define glBeginQuery _glBeginQuery
+#define glEndQuery _glEndQuery
+#define glGetQueryiv _glGetQueryiv
+#define glGetQueryObjectiv _glGetQueryObjectiv
+#define glGetQueryObjectui64v _glGetQueryObjectui64v
 
 static void
 debug_cb(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar *message, const void *data)
@@ -63,11 +145,43 @@ debug_cb(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length,
    WARNX("%s", message);
 }
 
+static bool
+has_gl_extension(const char *name)
+{
+   // glGetString(GL_EXTENSIONS) is gone from core profiles
+   if (OPENGL_VERSION.major >= 3 && glGetStringi) {
+      GLint count = 0;
+      glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+
+      for (GLint i = 0; i < count; ++i) {
+         const char *ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+         if (ext && !strcmp(ext, name))
+            return true;
+      }
+
+      return false;
+   }
+
+   const size_t len = strlen(name);
+   const char *exts = glGetString(GL_EXTENSIONS);
+   for (const char *p = exts; p && (p = strstr(p, name)); p += len) {
+      if ((p == exts || p[-1] == ' ') && (p[len] == ' ' || p[len] == 0))
+         return true;
+   }
+
+   return false;
+}
+
 static void*
 dlsym_proc(const char *procname)
 {
-   void *ptr = NULL;
-   hook_function(&ptr, procname, false, (const char*[]){ GL_LIBS, NULL });
+   // Not hook_function, as that one is fatal and GL_OPTIONAL functions are allowed to be missing
+   void *ptr = get_symbol(RTLD_NEXT, procname, false);
+
+   const char *srcs[] = { GL_LIBS };
+   for (size_t i = 0; !ptr && i < ARRAY_SIZE(srcs); ++i)
+      ptr = get_symbol(dlopen(srcs[i], RTLD_LAZY | RTLD_NOLOAD), procname, false);
+
    return ptr;
 }
 
@@ -122,6 +236,51 @@ load_gl_function_pointers(void* (*procs[])(const char*), const size_t memb)
    GL_REQUIRED(glClearColor);
    GL_REQUIRED(glClear);
    GL_OPTIONAL(glDebugMessageCallback);
+
+   // Only needed for the GPU conversion paths, which check for these before use
+   GL_OPTIONAL(glGenFramebuffers);
+   GL_OPTIONAL(glDeleteFramebuffers);
+   GL_OPTIONAL(glBindFramebuffer);
+   GL_OPTIONAL(glFramebufferTexture2D);
+   GL_OPTIONAL(glCheckFramebufferStatus);
+   GL_OPTIONAL(glGenTextures);
+   GL_OPTIONAL(glDeleteTextures);
+   GL_OPTIONAL(glBindTexture);
+   GL_OPTIONAL(glActiveTexture);
+   GL_OPTIONAL(glTexImage2D);
+   GL_OPTIONAL(glTexParameteri);
+   GL_OPTIONAL(glCreateShader);
+   GL_OPTIONAL(glShaderSource);
+   GL_OPTIONAL(glCompileShader);
+   GL_OPTIONAL(glGetShaderiv);
+   GL_OPTIONAL(glGetShaderInfoLog);
+   GL_OPTIONAL(glDeleteShader);
+   GL_OPTIONAL(glCreateProgram);
+   GL_OPTIONAL(glAttachShader);
+   GL_OPTIONAL(glLinkProgram);
+   GL_OPTIONAL(glGetProgramiv);
+   GL_OPTIONAL(glGetProgramInfoLog);
+   GL_OPTIONAL(glDeleteProgram);
+   GL_OPTIONAL(glUseProgram);
+   GL_OPTIONAL(glGetUniformLocation);
+   GL_OPTIONAL(glUniform1i);
+   GL_OPTIONAL(glUniform2i);
+   GL_OPTIONAL(glGenVertexArrays);
+   GL_OPTIONAL(glDeleteVertexArrays);
+   GL_OPTIONAL(glBindVertexArray);
+   GL_OPTIONAL(glBindSampler);
+   GL_OPTIONAL(glGetStringi);
+   GL_OPTIONAL(glFenceSync);
+   GL_OPTIONAL(glClientWaitSync);
+   GL_OPTIONAL(glDeleteSync);
+   GL_OPTIONAL(glDrawArrays);
+   GL_OPTIONAL(glViewport);
+   GL_OPTIONAL(glColorMask);
+   GL_OPTIONAL(glIsEnabled);
+
+   // Usually already set by our hook, unless the program itself never blits
+   if (!_glBlitFramebuffer)
+      GL_OPTIONAL(glBlitFramebuffer);
 #undef GL
 
    if (glDebugMessageCallback) {
@@ -141,6 +300,9 @@ load_gl_function_pointers(void* (*procs[])(const char*), const size_t memb)
    const char *version = glGetString(GL_VERSION);
    WARNX("%s", version);
 
+   // Desktop GL version string starts directly with the version number
+   OPENGL_VARIANT = OPENGL;
+
    for (size_t i = 0; i < ARRAY_SIZE(variants); ++i) {
       const size_t len = strlen(variants[i].p);
       if (strncmp(version, variants[i].p, len))
@@ -152,5 +314,37 @@ load_gl_function_pointers(void* (*procs[])(const char*), const size_t memb)
    }
 
    sscanf(version, "%u.%u", &OPENGL_VERSION.major, &OPENGL_VERSION.minor);
+
+   if (OPENGL_VARIANT == OPENGL_ES) {
+      if (has_gl_extension("GL_EXT_buffer_storage"))
+         _glBufferStorage = proc("glBufferStorageEXT");
+   } else if (OPENGL_VERSION.major > 4 || (OPENGL_VERSION.major == 4 && OPENGL_VERSION.minor >= 4) || has_gl_extension("GL_ARB_buffer_storage")) {
+      GL_OPTIONAL(glBufferStorage);
+   }
+
+   OPENGL_BUFFER_STORAGE = (glBufferStorage && glFenceSync && glClientWaitSync && glDeleteSync);
+   WARNX("persistently mapped pbos: %s", (OPENGL_BUFFER_STORAGE ? "yes" : "no"));
+
+   if (OPENGL_VARIANT == OPENGL_ES) {
+      if (has_gl_extension("GL_EXT_disjoint_timer_query")) {
+         _glGenQueries = proc("glGenQueriesEXT");
+         _glDeleteQueries = proc("glDeleteQueriesEXT");
+         _glBeginQuery = proc("glBeginQueryEXT");
+         _glEndQuery = proc("glEndQueryEXT");
+         _glGetQueryiv = proc("glGetQueryivEXT");
+         _glGetQueryObjectiv = proc("glGetQueryObjectivEXT");
+         _glGetQueryObjectui64v = proc("glGetQueryObjectui64vEXT");
+      }
+   } else if (OPENGL_VERSION.major > 3 || (OPENGL_VERSION.major == 3 && OPENGL_VERSION.minor >= 3) || has_gl_extension("GL_ARB_timer_query")) {
+      GL_OPTIONAL(glGenQueries);
+      GL_OPTIONAL(glDeleteQueries);
+      GL_OPTIONAL(glBeginQuery);
+      GL_OPTIONAL(glEndQuery);
+      GL_OPTIONAL(glGetQueryiv);
+      GL_OPTIONAL(glGetQueryObjectiv);
+      GL_OPTIONAL(glGetQueryObjectui64v);
+   }
+
+   OPENGL_TIMER_QUERY = (glGenQueries && glDeleteQueries && glBeginQuery && glEndQuery && glGetQueryiv && glGetQueryObjectiv && glGetQueryObjectui64v);
    loaded = true;
 }
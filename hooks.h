@@ -2,22 +2,66 @@
 
 static void* (*_dlsym)(void*, const char*);
 static void (*_glBlitFramebuffer)(GLint, GLint, GLint, GLint, GLint, GLint, GLint, GLint, GLbitfield, GLenum);
+static void (*_glBindBuffer)(GLenum, GLuint);
+static void (*_glDeleteBuffers)(GLsizei, const GLuint*);
+static void (*_glPixelStorei)(GLenum, GLint);
+static void (*_glPixelStoref)(GLenum, GLfloat);
+static void (*_glClearColor)(GLclampf, GLclampf, GLclampf, GLclampf);
+static void (*_glEnable)(GLenum);
+static void (*_glDisable)(GLenum);
+static void (*_glEnablei)(GLenum, GLuint);
+static void (*_glDisablei)(GLenum, GLuint);
+static void (*_glViewport)(GLint, GLint, GLsizei, GLsizei);
+static void (*_glColorMask)(GLboolean, GLboolean, GLboolean, GLboolean);
+static void (*_glUseProgram)(GLuint);
+static void (*_glBindVertexArray)(GLuint);
+static void (*_glDeleteVertexArrays)(GLsizei, const GLuint*);
+static void (*_glActiveTexture)(GLenum);
+static void (*_glActiveTextureARB)(GLenum);
+static void (*_glBindTexture)(GLenum, GLuint);
+static void (*_glDeleteTextures)(GLsizei, const GLuint*);
+static void (*_glBindTextureUnit)(GLuint, GLuint);
+static void (*_glBindTextures)(GLuint, GLsizei, const GLuint*);
+static void (*_glBindSampler)(GLuint, GLuint);
+static void (*_glBindSamplers)(GLuint, GLsizei, const GLuint*);
+static void (*_glBindFramebuffer)(GLenum, GLuint);
+static void (*_glDeleteFramebuffers)(GLsizei, const GLuint*);
+static void (*_glPopAttrib)(void);
+static void (*_glPopClientAttrib)(void);
+static void (*_glEndList)(void);
+static void (*_glCallList)(GLuint);
+static void (*_glCallLists)(GLsizei, GLenum, const GLvoid*);
+static void (*_glBeginQuery)(GLenum, GLuint);
+static void (*_glEndQuery)(GLenum);
+static void (*_glBeginQueryIndexed)(GLenum, GLuint, GLuint);
+static void (*_glEndQueryIndexed)(GLenum, GLuint);
+static EGLBoolean (*_eglMakeCurrent)(EGLDisplay, EGLSurface, EGLSurface, EGLContext);
 static EGLBoolean (*_eglSwapBuffers)(EGLDisplay, EGLSurface);
 static __eglMustCastToProperFunctionPointerType (*_eglGetProcAddress)(const char*);
 static void (*_glXSwapBuffers)(Display*, GLXDrawable);
+static Bool (*_glXMakeCurrent)(Display*, GLXDrawable, GLXContext);
+static Bool (*_glXMakeContextCurrent)(Display*, GLXDrawable, GLXDrawable, GLXContext);
 static __GLXextFuncPtr (*_glXGetProcAddress)(const GLubyte*);
 static __GLXextFuncPtr (*_glXGetProcAddressARB)(const GLubyte*);
 static snd_pcm_sframes_t (*_snd_pcm_writei)(snd_pcm_t*, const void*, snd_pcm_uframes_t);
 static snd_pcm_sframes_t (*_snd_pcm_writen)(snd_pcm_t*, void**, snd_pcm_uframes_t);
 static snd_pcm_sframes_t (*_snd_pcm_mmap_writei)(snd_pcm_t*, const void*, snd_pcm_uframes_t);
 static snd_pcm_sframes_t (*_snd_pcm_mmap_writen)(snd_pcm_t*, void**, snd_pcm_uframes_t);
+static int (*_snd_pcm_hw_params)(snd_pcm_t*, snd_pcm_hw_params_t*);
+static int (*_snd_pcm_prepare)(snd_pcm_t*);
+static int (*_snd_pcm_close)(snd_pcm_t*);
+static int (*_snd_pcm_mmap_begin)(snd_pcm_t*, const snd_pcm_channel_area_t**, snd_pcm_uframes_t*, snd_pcm_uframes_t*);
+static snd_pcm_sframes_t (*_snd_pcm_mmap_commit)(snd_pcm_t*, snd_pcm_uframes_t, snd_pcm_uframes_t);
 static int (*_clock_gettime)(clockid_t, struct timespec*);
+static __typeof__(gettimeofday) *_gettimeofday;
+static time_t (*_time)(time_t*);
 static void* store_real_symbol_and_return_fake_symbol(const char*, void*);
 static void hook_function(void**, const char*, const bool, const char*[]);
 static void hook_dlsym(void**, const char*);
 
-#define HOOK(x) hook_function((void**)&_##x, #x, false, NULL)
-#define HOOK_FROM(x, ...) hook_function((void**)&_##x, #x, false, (const char*[]){ __VA_ARGS__, NULL })
+// Pointer is checked inline, so hooks that already resolved cost nothing extra
+#define HOOK(x) (_##x ? (void)0 : hook_function((void**)&_##x, #x, false, NULL))
+#define HOOK_FROM(x, ...) (_##x ? (void)0 : hook_function((void**)&_##x, #x, false, (const char*[]){ __VA_ARGS__, NULL }))
 
 // Use HOOK_FROM with this list for any GL/GLX stuff
 #define GL_LIBS "libGL.so", "libGLESv1_CM.so", "libGLESv2.so", "libGLX.so"
@@ -31,6 +75,333 @@ glBlitFramebuffer(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX
    _glBlitFramebuffer(srcX0, srcY0, srcX1, srcY1, dstX0, dstY0, dstX1, dstY1, mask, filter);
 }
 
+// State changes the capture code cares about, see glshadow.h
+// Extension aliases only reach these through *GetProcAddress, see store_real_symbol_and_return_fake_symbol
+
+void
+glBindBuffer(GLenum target, GLuint buffer)
+{
+   HOOK_FROM(glBindBuffer, GL_LIBS);
+   if (target == GL_PIXEL_PACK_BUFFER) shadow_set(SHADOW_PACK_BUFFER, buffer);
+   if (target == GL_PIXEL_UNPACK_BUFFER) shadow_set(SHADOW_UNPACK_BUFFER, buffer);
+   _glBindBuffer(target, buffer);
+}
+
+void
+glDeleteBuffers(GLsizei n, const GLuint *buffers)
+{
+   HOOK_FROM(glDeleteBuffers, GL_LIBS);
+   shadow_delete(SHADOW_PACK_BUFFER, n, buffers);
+   shadow_delete(SHADOW_UNPACK_BUFFER, n, buffers);
+   _glDeleteBuffers(n, buffers);
+}
+
+void
+glPixelStorei(GLenum pname, GLint param)
+{
+   HOOK_FROM(glPixelStorei, GL_LIBS);
+   switch (pname) {
+      case GL_PACK_ALIGNMENT: shadow_set(SHADOW_PACK_ALIGNMENT, param); break;
+      case GL_PACK_ROW_LENGTH: shadow_set(SHADOW_PACK_ROW_LENGTH, param); break;
+      case GL_PACK_IMAGE_HEIGHT: shadow_set(SHADOW_PACK_IMAGE_HEIGHT, param); break;
+      case GL_PACK_SKIP_PIXELS: shadow_set(SHADOW_PACK_SKIP_PIXELS, param); break;
+   }
+   _glPixelStorei(pname, param);
+}
+
+void
+glPixelStoref(GLenum pname, GLfloat param)
+{
+   HOOK_FROM(glPixelStoref, GL_LIBS);
+   // Rounding of the float is up to the driver, so just ask it later
+   switch (pname) {
+      case GL_PACK_ALIGNMENT: shadow_invalidate(SHADOW_PACK_ALIGNMENT); break;
+      case GL_PACK_ROW_LENGTH: shadow_invalidate(SHADOW_PACK_ROW_LENGTH); break;
+      case GL_PACK_IMAGE_HEIGHT: shadow_invalidate(SHADOW_PACK_IMAGE_HEIGHT); break;
+      case GL_PACK_SKIP_PIXELS: shadow_invalidate(SHADOW_PACK_SKIP_PIXELS); break;
+   }
+   _glPixelStoref(pname, param);
+}
+
+void
+glClearColor(GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha)
+{
+   HOOK_FROM(glClearColor, GL_LIBS);
+   // Possible clamping happens again when we restore it, so store as is
+   memcpy(GL_SHADOW.clear_color, (GLfloat[]){ red, green, blue, alpha }, sizeof(GL_SHADOW.clear_color));
+   GL_SHADOW.valid |= (1 << SHADOW_CLEAR_COLOR);
+   _glClearColor(red, green, blue, alpha);
+}
+
+void
+glEnable(GLenum cap)
+{
+   HOOK_FROM(glEnable, GL_LIBS);
+   shadow_cap(cap, true);
+   _glEnable(cap);
+}
+
+void
+glDisable(GLenum cap)
+{
+   HOOK_FROM(glDisable, GL_LIBS);
+   shadow_cap(cap, false);
+   _glDisable(cap);
+}
+
+// glIsEnabled (and so the shadow) is the state of index 0, other indices aren't tracked
+void
+glEnablei(GLenum cap, GLuint index)
+{
+   HOOK_FROM(glEnablei, GL_LIBS);
+   if (index == 0) shadow_cap(cap, true);
+   _glEnablei(cap, index);
+}
+
+void
+glDisablei(GLenum cap, GLuint index)
+{
+   HOOK_FROM(glDisablei, GL_LIBS);
+   if (index == 0) shadow_cap(cap, false);
+   _glDisablei(cap, index);
+}
+
+void
+glViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+   HOOK_FROM(glViewport, GL_LIBS);
+   // Negative sizes are an error and don't change the state
+   if (width >= 0 && height >= 0) {
+      memcpy(GL_SHADOW.viewport, (GLint[]){ x, y, width, height }, sizeof(GL_SHADOW.viewport));
+      GL_SHADOW.valid |= (1 << SHADOW_VIEWPORT);
+   }
+   _glViewport(x, y, width, height);
+}
+
+void
+glColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha)
+{
+   HOOK_FROM(glColorMask, GL_LIBS);
+   memcpy(GL_SHADOW.color_mask, (GLboolean[]){ red, green, blue, alpha }, sizeof(GL_SHADOW.color_mask));
+   GL_SHADOW.valid |= (1 << SHADOW_COLOR_MASK);
+   _glColorMask(red, green, blue, alpha);
+}
+
+void
+glUseProgram(GLuint program)
+{
+   HOOK_FROM(glUseProgram, GL_LIBS);
+   shadow_set(SHADOW_PROGRAM, program);
+   _glUseProgram(program);
+}
+
+void
+glBindVertexArray(GLuint array)
+{
+   HOOK_FROM(glBindVertexArray, GL_LIBS);
+   shadow_set(SHADOW_VAO, array);
+   _glBindVertexArray(array);
+}
+
+void
+glDeleteVertexArrays(GLsizei n, const GLuint *arrays)
+{
+   HOOK_FROM(glDeleteVertexArrays, GL_LIBS);
+   shadow_delete(SHADOW_VAO, n, arrays);
+   _glDeleteVertexArrays(n, arrays);
+}
+
+void
+glActiveTexture(GLenum texture)
+{
+   HOOK_FROM(glActiveTexture, GL_LIBS);
+   shadow_set(SHADOW_ACTIVE_TEXTURE, texture);
+   _glActiveTexture(texture);
+}
+
+void
+glActiveTextureARB(GLenum texture)
+{
+   // libGL exports this one, so old programs may call it directly
+   HOOK_FROM(glActiveTextureARB, GL_LIBS);
+   shadow_set(SHADOW_ACTIVE_TEXTURE, texture);
+   _glActiveTextureARB(texture);
+}
+
+void
+glBindTexture(GLenum target, GLuint texture)
+{
+   HOOK_FROM(glBindTexture, GL_LIBS);
+   if (target == GL_TEXTURE_2D) {
+      if (!(GL_SHADOW.valid & (1 << SHADOW_ACTIVE_TEXTURE)))
+         shadow_invalidate(SHADOW_TEXTURE);
+      else if (GL_SHADOW.value[SHADOW_ACTIVE_TEXTURE] == GL_TEXTURE0)
+         shadow_set(SHADOW_TEXTURE, texture);
+   }
+   _glBindTexture(target, texture);
+}
+
+void
+glDeleteTextures(GLsizei n, const GLuint *textures)
+{
+   HOOK_FROM(glDeleteTextures, GL_LIBS);
+   shadow_delete(SHADOW_TEXTURE, n, textures);
+   _glDeleteTextures(n, textures);
+}
+
+// DSA and multi-bind don't name the target, it's whatever the texture was created as, so only unbinding is known
+void
+glBindTextureUnit(GLuint unit, GLuint texture)
+{
+   HOOK_FROM(glBindTextureUnit, GL_LIBS);
+   if (unit == 0) shadow_invalidate(SHADOW_TEXTURE);
+   _glBindTextureUnit(unit, texture);
+}
+
+void
+glBindTextures(GLuint first, GLsizei count, const GLuint *textures)
+{
+   HOOK_FROM(glBindTextures, GL_LIBS);
+   if (first == 0 && count > 0) {
+      if (!textures) shadow_set(SHADOW_TEXTURE, 0);
+      else shadow_invalidate(SHADOW_TEXTURE);
+   }
+   _glBindTextures(first, count, textures);
+}
+
+void
+glBindSampler(GLuint unit, GLuint sampler)
+{
+   HOOK_FROM(glBindSampler, GL_LIBS);
+   if (unit == 0) shadow_set(SHADOW_SAMPLER, sampler);
+   _glBindSampler(unit, sampler);
+}
+
+void
+glBindSamplers(GLuint first, GLsizei count, const GLuint *samplers)
+{
+   HOOK_FROM(glBindSamplers, GL_LIBS);
+   if (first == 0 && count > 0) shadow_set(SHADOW_SAMPLER, (samplers ? samplers[0] : 0));
+   _glBindSamplers(first, count, samplers);
+}
+
+void
+glBindFramebuffer(GLenum target, GLuint framebuffer)
+{
+   HOOK_FROM(glBindFramebuffer, GL_LIBS);
+   if (target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER) shadow_set(SHADOW_DRAW_FBO, framebuffer);
+   if (target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER) shadow_set(SHADOW_READ_FBO, framebuffer);
+   _glBindFramebuffer(target, framebuffer);
+}
+
+void
+glDeleteFramebuffers(GLsizei n, const GLuint *framebuffers)
+{
+   HOOK_FROM(glDeleteFramebuffers, GL_LIBS);
+   shadow_delete(SHADOW_DRAW_FBO, n, framebuffers);
+   shadow_delete(SHADOW_READ_FBO, n, framebuffers);
+   _glDeleteFramebuffers(n, framebuffers);
+}
+
+void
+glPopAttrib(void)
+{
+   HOOK_FROM(glPopAttrib, GL_LIBS);
+   shadow_invalidate_all();
+   _glPopAttrib();
+}
+
+void
+glPopClientAttrib(void)
+{
+   HOOK_FROM(glPopClientAttrib, GL_LIBS);
+   shadow_invalidate_all();
+   _glPopClientAttrib();
+}
+
+// Calls compiled to a display list went through our hooks without changing anything yet
+void
+glEndList(void)
+{
+   HOOK_FROM(glEndList, GL_LIBS);
+   shadow_invalidate_all();
+   _glEndList();
+}
+
+// Display lists change state without going through our hooks
+void
+glCallList(GLuint list)
+{
+   HOOK_FROM(glCallList, GL_LIBS);
+   shadow_invalidate_all();
+   _glCallList(list);
+}
+
+void
+glCallLists(GLsizei n, GLenum type, const GLvoid *lists)
+{
+   HOOK_FROM(glCallLists, GL_LIBS);
+   shadow_invalidate_all();
+   _glCallLists(n, type, lists);
+}
+
+// Only GL_TIME_ELAPSED is tracked, begin_gpu_timer has to stay out of the program's own timer
+void
+glBeginQuery(GLenum target, GLuint id)
+{
+   HOOK_FROM(glBeginQuery, GL_LIBS);
+   if (target == GL_TIME_ELAPSED) shadow_set(SHADOW_TIME_QUERY, id);
+   _glBeginQuery(target, id);
+}
+
+void
+glEndQuery(GLenum target)
+{
+   HOOK_FROM(glEndQuery, GL_LIBS);
+   if (target == GL_TIME_ELAPSED) shadow_set(SHADOW_TIME_QUERY, 0);
+   _glEndQuery(target);
+}
+
+void
+glBeginQueryIndexed(GLenum target, GLuint index, GLuint id)
+{
+   HOOK_FROM(glBeginQueryIndexed, GL_LIBS);
+   if (target == GL_TIME_ELAPSED && index == 0) shadow_set(SHADOW_TIME_QUERY, id);
+   _glBeginQueryIndexed(target, index, id);
+}
+
+void
+glEndQueryIndexed(GLenum target, GLuint index)
+{
+   HOOK_FROM(glEndQueryIndexed, GL_LIBS);
+   if (target == GL_TIME_ELAPSED && index == 0) shadow_set(SHADOW_TIME_QUERY, 0);
+   _glEndQueryIndexed(target, index);
+}
+
+EGLBoolean
+eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLContext ctx)
+{
+   HOOK_FROM(eglMakeCurrent, "libEGL.so");
+   shadow_invalidate_all();
+   return _eglMakeCurrent(dpy, draw, read, ctx);
+}
+
+Bool
+glXMakeCurrent(Display *dpy, GLXDrawable drawable, GLXContext ctx)
+{
+   HOOK_FROM(glXMakeCurrent, GL_LIBS);
+   shadow_invalidate_all();
+   return _glXMakeCurrent(dpy, drawable, ctx);
+}
+
+Bool
+glXMakeContextCurrent(Display *dpy, GLXDrawable draw, GLXDrawable read, GLXContext ctx)
+{
+   HOOK_FROM(glXMakeContextCurrent, GL_LIBS);
+   shadow_invalidate_all();
+   return _glXMakeContextCurrent(dpy, draw, read, ctx);
+}
+
 EGLBoolean
 eglSwapBuffers(EGLDisplay dpy, EGLSurface surface)
 {
@@ -68,20 +439,54 @@ glXGetProcAddress(const GLubyte *procname)
    return (_glXGetProcAddress ? store_real_symbol_and_return_fake_symbol((const char*)procname, _glXGetProcAddress(procname)) : NULL);
 }
 
+int
+snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+   HOOK(snd_pcm_hw_params);
+   const int ret = _snd_pcm_hw_params(pcm, params);
+   if (ret >= 0)
+      alsa_configure(pcm, params);
+   return ret;
+}
+
+int
+snd_pcm_prepare(snd_pcm_t *pcm)
+{
+   HOOK(snd_pcm_prepare);
+   const int ret = _snd_pcm_prepare(pcm);
+   if (ret >= 0)
+      alsa_configure(pcm, NULL);
+   return ret;
+}
+
+int
+snd_pcm_close(snd_pcm_t *pcm)
+{
+   HOOK(snd_pcm_close);
+   alsa_close(pcm);
+   return _snd_pcm_close(pcm);
+}
+
 snd_pcm_sframes_t
 snd_pcm_writei(snd_pcm_t *pcm, const void *buffer, snd_pcm_uframes_t size)
 {
    HOOK(snd_pcm_writei);
    alsa_writei(pcm, buffer, size, __func__);
-   return _snd_pcm_writei(pcm, buffer, size);
+   ALSA_WRITING++;
+   const snd_pcm_sframes_t ret = _snd_pcm_writei(pcm, buffer, size);
+   ALSA_WRITING--;
+   return ret;
 }
 
 snd_pcm_sframes_t
 snd_pcm_writen(snd_pcm_t *pcm, void **bufs, snd_pcm_uframes_t size)
 {
    HOOK(snd_pcm_writen);
-   // FIXME: Implement
-   return _snd_pcm_writen(pcm, bufs, size);
+   alsa_writen(pcm, bufs, size, __func__);
+   ALSA_WRITING++;
+   const snd_pcm_sframes_t ret = _snd_pcm_writen(pcm, bufs, size);
+   ALSA_WRITING--;
+   return ret;
 }
 
 snd_pcm_sframes_t
@@ -89,27 +494,98 @@ snd_pcm_mmap_writei(snd_pcm_t *pcm, const void *buffer, snd_pcm_uframes_t size)
 {
    HOOK(snd_pcm_mmap_writei);
    alsa_writei(pcm, buffer, size, __func__);
-   return _snd_pcm_mmap_writei(pcm, buffer, size);
+   ALSA_WRITING++;
+   const snd_pcm_sframes_t ret = _snd_pcm_mmap_writei(pcm, buffer, size);
+   ALSA_WRITING--;
+   return ret;
 }
 
 snd_pcm_sframes_t
 snd_pcm_mmap_writen(snd_pcm_t *pcm, void **bufs, snd_pcm_uframes_t size)
 {
    HOOK(snd_pcm_mmap_writen);
-   // FIXME: Implement
-   return _snd_pcm_mmap_writen(pcm, bufs, size);
+   alsa_writen(pcm, bufs, size, __func__);
+   ALSA_WRITING++;
+   const snd_pcm_sframes_t ret = _snd_pcm_mmap_writen(pcm, bufs, size);
+   ALSA_WRITING--;
+   return ret;
+}
+
+int
+snd_pcm_mmap_begin(snd_pcm_t *pcm, const snd_pcm_channel_area_t **areas, snd_pcm_uframes_t *offset, snd_pcm_uframes_t *frames)
+{
+   HOOK(snd_pcm_mmap_begin);
+   // Plugin PCMs (dmix, plug, rate...) begin and commit on their slave from inside, only the outermost call is ours
+   ALSA_WRITING++;
+   const int ret = _snd_pcm_mmap_begin(pcm, areas, offset, frames);
+   ALSA_WRITING--;
+   if (ret >= 0)
+      alsa_mmap_begin(pcm, *areas);
+   return ret;
+}
+
+snd_pcm_sframes_t
+snd_pcm_mmap_commit(snd_pcm_t *pcm, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+   HOOK(snd_pcm_mmap_commit);
+   ALSA_WRITING++;
+   const snd_pcm_sframes_t ret = _snd_pcm_mmap_commit(pcm, offset, frames);
+   ALSA_WRITING--;
+   if (ret > 0)
+      alsa_mmap_commit(pcm, offset, ret, __func__);
+   return ret;
 }
 
 int
 clock_gettime(clockid_t clk_id, struct timespec *tp)
 {
    HOOK(clock_gettime);
+
+   if (!TIME_SCALING || !is_scaled_clock(clk_id))
+      return _clock_gettime(clk_id, tp);
+
    const uint64_t fake = get_fake_time_ns(clk_id);
    tp->tv_sec = fake / (uint64_t)1e9;
    tp->tv_nsec = (fake % (uint64_t)1e9);
    return 0;
 }
 
+// glibc before 2.31 declares tz as struct timezone* under _GNU_SOURCE, later ones as void*
+// Defined under another C name so the system's prototype is never restated, the symbol is still gettimeofday
+int hook_gettimeofday(struct timeval *tv, void *tz) __asm__("gettimeofday");
+
+int
+hook_gettimeofday(struct timeval *tv, void *tz)
+{
+   HOOK(gettimeofday);
+
+   if (!TIME_SCALING)
+      return _gettimeofday(tv, tz);
+
+   // Real call still fills the obsolete timezone
+   if (tz)
+      _gettimeofday(tv, tz);
+
+   const uint64_t fake = get_fake_time_ns(CLOCK_REALTIME);
+   tv->tv_sec = fake / (uint64_t)1e9;
+   tv->tv_usec = (fake % (uint64_t)1e9) / 1000;
+   return 0;
+}
+
+time_t
+time(time_t *tloc)
+{
+   HOOK(time);
+
+   if (!TIME_SCALING)
+      return _time(tloc);
+
+   const time_t fake = get_fake_time_ns(CLOCK_REALTIME) / (uint64_t)1e9;
+   if (tloc)
+      *tloc = fake;
+   return fake;
+}
+
 static void*
 store_real_symbol_and_return_fake_symbol(const char *symbol, void *ret)
 {
@@ -119,17 +595,82 @@ store_real_symbol_and_return_fake_symbol(const char *symbol, void *ret)
    if (0) {}
 #define SET_IF_NOT_HOOKED(x, y) do { if (!_##x) { _##x = y; WARNX("SET %s to %p", #x, y); } } while (0)
 #define FAKE_SYMBOL(x) else if (!strcmp(symbol, #x)) { SET_IF_NOT_HOOKED(x, ret); return x; }
+#define FAKE_ALIAS(x, y) else if (!strcmp(symbol, #y)) { SET_IF_NOT_HOOKED(x, ret); return x; }
    FAKE_SYMBOL(glBlitFramebuffer)
+   FAKE_SYMBOL(glBindBuffer)
+   FAKE_ALIAS(glBindBuffer, glBindBufferARB)
+   FAKE_SYMBOL(glDeleteBuffers)
+   FAKE_ALIAS(glDeleteBuffers, glDeleteBuffersARB)
+   FAKE_SYMBOL(glPixelStorei)
+   FAKE_SYMBOL(glPixelStoref)
+   FAKE_SYMBOL(glClearColor)
+   FAKE_SYMBOL(glEnable)
+   FAKE_SYMBOL(glDisable)
+   FAKE_SYMBOL(glEnablei)
+   FAKE_ALIAS(glEnablei, glEnableiEXT)
+   FAKE_ALIAS(glEnablei, glEnableiOES)
+   FAKE_ALIAS(glEnablei, glEnableIndexedEXT)
+   FAKE_SYMBOL(glDisablei)
+   FAKE_ALIAS(glDisablei, glDisableiEXT)
+   FAKE_ALIAS(glDisablei, glDisableiOES)
+   FAKE_ALIAS(glDisablei, glDisableIndexedEXT)
+   FAKE_SYMBOL(glViewport)
+   FAKE_SYMBOL(glColorMask)
+   FAKE_SYMBOL(glUseProgram)
+   FAKE_ALIAS(glUseProgram, glUseProgramObjectARB)
+   FAKE_SYMBOL(glBindVertexArray)
+   FAKE_ALIAS(glBindVertexArray, glBindVertexArrayOES)
+   FAKE_SYMBOL(glDeleteVertexArrays)
+   FAKE_ALIAS(glDeleteVertexArrays, glDeleteVertexArraysOES)
+   FAKE_SYMBOL(glActiveTexture)
+   FAKE_SYMBOL(glActiveTextureARB)
+   FAKE_SYMBOL(glBindTexture)
+   FAKE_ALIAS(glBindTexture, glBindTextureEXT)
+   FAKE_SYMBOL(glDeleteTextures)
+   FAKE_SYMBOL(glBindTextureUnit)
+   FAKE_SYMBOL(glBindTextures)
+   FAKE_SYMBOL(glBindSampler)
+   FAKE_SYMBOL(glBindSamplers)
+   FAKE_SYMBOL(glBindFramebuffer)
+   FAKE_ALIAS(glBindFramebuffer, glBindFramebufferEXT)
+   FAKE_ALIAS(glBindFramebuffer, glBindFramebufferOES)
+   FAKE_SYMBOL(glDeleteFramebuffers)
+   FAKE_ALIAS(glDeleteFramebuffers, glDeleteFramebuffersEXT)
+   FAKE_ALIAS(glDeleteFramebuffers, glDeleteFramebuffersOES)
+   FAKE_SYMBOL(glPopAttrib)
+   FAKE_SYMBOL(glPopClientAttrib)
+   FAKE_SYMBOL(glEndList)
+   FAKE_SYMBOL(glCallList)
+   FAKE_SYMBOL(glCallLists)
+   FAKE_SYMBOL(glBeginQuery)
+   FAKE_ALIAS(glBeginQuery, glBeginQueryARB)
+   FAKE_ALIAS(glBeginQuery, glBeginQueryEXT)
+   FAKE_SYMBOL(glEndQuery)
+   FAKE_ALIAS(glEndQuery, glEndQueryARB)
+   FAKE_ALIAS(glEndQuery, glEndQueryEXT)
+   FAKE_SYMBOL(glBeginQueryIndexed)
+   FAKE_SYMBOL(glEndQueryIndexed)
+   FAKE_SYMBOL(eglMakeCurrent)
+   FAKE_SYMBOL(glXMakeCurrent)
+   FAKE_SYMBOL(glXMakeContextCurrent)
    FAKE_SYMBOL(eglSwapBuffers)
    FAKE_SYMBOL(eglGetProcAddress)
    FAKE_SYMBOL(glXSwapBuffers)
    FAKE_SYMBOL(glXGetProcAddressARB)
    FAKE_SYMBOL(glXGetProcAddress)
+   FAKE_SYMBOL(snd_pcm_hw_params)
+   FAKE_SYMBOL(snd_pcm_prepare)
+   FAKE_SYMBOL(snd_pcm_close)
    FAKE_SYMBOL(snd_pcm_writei)
    FAKE_SYMBOL(snd_pcm_writen)
    FAKE_SYMBOL(snd_pcm_mmap_writei)
    FAKE_SYMBOL(snd_pcm_mmap_writen)
+   FAKE_SYMBOL(snd_pcm_mmap_begin)
+   FAKE_SYMBOL(snd_pcm_mmap_commit)
    FAKE_SYMBOL(clock_gettime)
+   FAKE_SYMBOL(gettimeofday)
+   FAKE_SYMBOL(time)
+#undef FAKE_ALIAS
 #undef FAKE_SYMBOL
 #undef SET_IF_NOT_HOOKED
 
@@ -0,0 +1,298 @@
+/* gcc -std=c99 -O2 pipebench.c -o pipebench
+ *
+ * Throughput of the ways glcapture has written packets into its pipe, with a reader process draining it like ffmpeg would
+ * fwrite: header and payload through stdio with setvbuf(pipe size / 8), what glcapture did before vmsplice
+ * write: header and payload in one page aligned buffer, write() of all of it, glcapture's fallback path
+ * vmsplice: same buffers spliced into the pipe and recycled once a pipe's worth of pages went in after them
+ * Every packet is first copied into its buffer from a source frame, as the readback does
+ * Usage: ./pipebench [-s 1920x1080] [-n 600]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+// Same as glcapture's
+#define NUM_SPLICED 32
+#define TARGET_FPS 60
+
+enum mode {
+   MODE_FWRITE,
+   MODE_WRITE,
+   MODE_VMSPLICE,
+};
+
+static const char *NAMES[] = {
+   [MODE_FWRITE] = "fwrite",
+   [MODE_WRITE] = "write",
+   [MODE_VMSPLICE] = "vmsplice",
+};
+
+struct buffer {
+   uint8_t *data; // page of headroom in front, packet header goes to its end
+   size_t allocated;
+};
+
+// Buffers that are in the pipe, see pool_collect in glcapture.c
+struct pool {
+   struct {
+      struct buffer buffer;
+      uint64_t release;
+   } busy[NUM_SPLICED];
+
+   struct buffer spare[NUM_SPLICED];
+   uint32_t busy_head, busy_tail, spares;
+   uint64_t spliced, capacity; // pages
+};
+
+static uint64_t
+now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+page_size(void)
+{
+   static size_t size;
+   return (size ? size : (size = sysconf(_SC_PAGESIZE)));
+}
+
+static struct buffer
+buffer_new(const size_t size)
+{
+   const size_t page = page_size();
+   const size_t needed = page + ((size + page - 1) & ~(page - 1));
+
+   void *base;
+   if ((base = mmap(NULL, needed, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+      err(EXIT_FAILURE, "mmap(%zu)", needed);
+
+   return (struct buffer){ .data = (uint8_t*)base + page, .allocated = needed };
+}
+
+static void
+buffer_free(struct buffer *buffer)
+{
+   if (buffer->data)
+      munmap(buffer->data - page_size(), buffer->allocated);
+
+   *buffer = (struct buffer){0};
+}
+
+static void
+fill_packet(uint8_t *packet, const uint8_t *frame, const uint32_t size, const uint64_t pts)
+{
+   packet[0] = 0;
+   memcpy(packet + 1, &size, sizeof(size));
+   memcpy(packet + 5, &pts, sizeof(pts));
+   memcpy(packet + 13, frame, size);
+}
+
+static void
+write_all(const int fd, const void *data, const size_t size)
+{
+   for (size_t off = 0; off < size;) {
+      const ssize_t ret = write(fd, (const uint8_t*)data + off, size - off);
+
+      if (ret < 0 && errno == EINTR)
+         continue;
+
+      if (ret <= 0)
+         err(EXIT_FAILURE, "write");
+
+      off += ret;
+   }
+}
+
+static void
+splice_all(const int fd, struct pool *pool, struct buffer *buffer, const uint8_t *data, const size_t size)
+{
+   for (; pool->busy_tail != pool->busy_head && pool->spliced - pool->busy[pool->busy_tail].release >= pool->capacity;
+        pool->busy_tail = (pool->busy_tail + 1) % NUM_SPLICED)
+      pool->spare[pool->spares++] = pool->busy[pool->busy_tail].buffer;
+
+   if ((pool->busy_head + 1) % NUM_SPLICED == pool->busy_tail) {
+      write_all(fd, data, size);
+      return;
+   }
+
+   struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+   while (iov.iov_len > 0) {
+      const ssize_t ret = vmsplice(fd, &iov, 1, 0);
+
+      if (ret < 0 && errno == EINTR)
+         continue;
+
+      if (ret <= 0)
+         err(EXIT_FAILURE, "vmsplice");
+
+      iov.iov_base = (uint8_t*)iov.iov_base + ret;
+      iov.iov_len -= ret;
+   }
+
+   const uintptr_t page = page_size();
+   pool->spliced += (((uintptr_t)data + size + page - 1) / page) - ((uintptr_t)data / page);
+   pool->busy[pool->busy_head].buffer = *buffer;
+   pool->busy[pool->busy_head].release = pool->spliced;
+   pool->busy_head = (pool->busy_head + 1) % NUM_SPLICED;
+   *buffer = (pool->spares ? pool->spare[--pool->spares] : buffer_new(size - 13));
+}
+
+// Reads everything into a buffer until the writer closes, returns the bytes read
+static uint64_t
+drain(const int fd)
+{
+   static uint8_t data[1 << 20];
+   uint64_t total = 0;
+
+   for (ssize_t ret; (ret = read(fd, data, sizeof(data))) != 0; total += (ret > 0 ? ret : 0)) {
+      if (ret < 0 && errno != EINTR)
+         err(EXIT_FAILURE, "read");
+   }
+
+   return total;
+}
+
+// ns it took to get every frame through the pipe and read, reader runs in its own process
+static uint64_t
+run(const enum mode mode, const uint8_t *frame, const uint32_t size, const uint32_t frames)
+{
+   int fds[2];
+   if (pipe2(fds, O_CLOEXEC) == -1)
+      err(EXIT_FAILURE, "pipe2");
+
+   // Pipe size glcapture picked before vmsplice, a quarter second of frames
+   const long pipe_sz = (long)(TARGET_FPS / 4) * (size + 13);
+   long fifo_size;
+   if ((fifo_size = fcntl(fds[1], F_SETPIPE_SZ, pipe_sz)) == -1 && (fifo_size = fcntl(fds[1], F_GETPIPE_SZ)) == -1)
+      err(EXIT_FAILURE, "fcntl");
+
+   const uint64_t start = now_ns();
+
+   pid_t reader;
+   if ((reader = fork()) == -1)
+      err(EXIT_FAILURE, "fork");
+
+   if (!reader) {
+      close(fds[1]);
+      const uint64_t expected = (uint64_t)frames * (size + 13);
+      _exit(drain(fds[0]) == expected ? EXIT_SUCCESS : EXIT_FAILURE);
+   }
+
+   close(fds[0]);
+
+   struct pool pool = { .capacity = fifo_size / page_size() };
+   struct buffer buffer = buffer_new(size);
+   uint8_t *packet = buffer.data - 13;
+
+   if (mode == MODE_FWRITE) {
+      FILE *f;
+      if (!(f = fdopen(fds[1], "wb")))
+         err(EXIT_FAILURE, "fdopen");
+
+      setvbuf(f, NULL, _IOFBF, fifo_size / 8);
+
+      for (uint32_t i = 0; i < frames; ++i) {
+         fill_packet(packet, frame, size, i);
+         if (fwrite(packet, 1, 13, f) != 13 || fwrite(packet + 13, 1, size, f) != size)
+            err(EXIT_FAILURE, "fwrite");
+      }
+
+      fclose(f);
+   } else {
+      for (uint32_t i = 0; i < frames; ++i) {
+         packet = buffer.data - 13;
+         fill_packet(packet, frame, size, i);
+
+         if (mode == MODE_VMSPLICE) {
+            splice_all(fds[1], &pool, &buffer, packet, size + 13);
+         } else {
+            write_all(fds[1], packet, size + 13);
+         }
+      }
+
+      close(fds[1]);
+   }
+
+   int status;
+   if (waitpid(reader, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      errx(EXIT_FAILURE, "%s: reader didn't get every byte", NAMES[mode]);
+
+   const uint64_t elapsed = now_ns() - start;
+
+   // Pipe is gone, so are its references to the pages
+   buffer_free(&buffer);
+   for (; pool.busy_tail != pool.busy_head; pool.busy_tail = (pool.busy_tail + 1) % NUM_SPLICED)
+      buffer_free(&pool.busy[pool.busy_tail].buffer);
+   while (pool.spares)
+      buffer_free(&pool.spare[--pool.spares]);
+
+   return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+   uint32_t width = 1920, height = 1080, frames = 600;
+
+   for (int opt; (opt = getopt(argc, argv, "s:n:")) != -1;) {
+      switch (opt) {
+         case 's':
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2)
+               width = 0;
+            break;
+         case 'n': frames = strtoul(optarg, NULL, 10); break;
+         default: width = 0; break;
+      }
+   }
+
+   if (optind != argc || !width || !height || !frames) {
+      fprintf(stderr, "usage: %s [-s 1920x1080] [-n 600]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   // Source frame is touched once so its pages exist before timing
+   const uint32_t size = width * height * 3;
+   uint8_t *frame;
+   if (!(frame = malloc(size)))
+      err(EXIT_FAILURE, "malloc");
+
+   for (uint32_t i = 0; i < size; ++i)
+      frame[i] = i * 7;
+
+   printf("%ux%u rgb, %u frames of %.1f MiB\n", width, height, frames, size / (1024.0 * 1024.0));
+   printf("%-10s %10s %10s\n", "path", "GiB/s", "ms/frame");
+
+   // Best of a few rounds, rounds alternate between the paths so they all see the same conditions
+   uint64_t best[ARRAY_SIZE(NAMES)] = {0};
+   for (int round = 0; round < 3; ++round) {
+      for (size_t i = 0; i < ARRAY_SIZE(NAMES); ++i) {
+         const uint64_t ns = run(i, frame, size, frames);
+         best[i] = (!round || ns < best[i] ? ns : best[i]);
+      }
+   }
+
+   for (size_t i = 0; i < ARRAY_SIZE(NAMES); ++i) {
+      printf("%-10s %10.2f %10.2f\n", NAMES[i], (double)frames * (size + 13) / best[i] * 1e9 / (1024.0 * 1024.0 * 1024.0),
+             best[i] / 1e6 / frames);
+   }
+
+   free(frame);
+   return EXIT_SUCCESS;
+}
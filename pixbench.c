@@ -0,0 +1,188 @@
+/* gcc -std=c99 -O2 pixbench.c -o pixbench
+ *
+ * Checks and times the row packing kernels of pixels.h
+ * Every kernel the cpu has is run for widths 1..max against the scalar loop, with the source and destination rows
+ * ending right before an unmapped page, so reading or writing past the row crashes instead of passing
+ * Then times each kernel and copy_rows (flipped, with the kernel it picks) over a frame
+ * Usage: ./pixbench [-t 256] [-s 1920x1080] [-n 200]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+#define WARNX(...) warnx(__VA_ARGS__)
+
+#include "pixels.h"
+
+struct kernel {
+   const char *name;
+   pack_row_fn fn;
+};
+
+static const struct kernel KERNELS[] = {
+   { "scalar", pack_rgb_scalar },
+#if PIXELS_X86
+   { "ssse3", pack_rgb_ssse3 },
+   { "avx2", pack_rgb_avx2 },
+#endif
+};
+
+static uint64_t
+now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+kernel_supported(const struct kernel *kernel)
+{
+#if PIXELS_X86
+   // __builtin_cpu_supports only takes literals
+   __builtin_cpu_init();
+   if (kernel->fn == pack_rgb_ssse3)
+      return __builtin_cpu_supports("ssse3");
+   if (kernel->fn == pack_rgb_avx2)
+      return __builtin_cpu_supports("avx2");
+#endif
+   (void)kernel;
+   return true;
+}
+
+// Returns size bytes that end right before a PROT_NONE page
+static uint8_t*
+guarded(const size_t size)
+{
+   const size_t page = sysconf(_SC_PAGESIZE);
+   const size_t pages = (size + page - 1) / page;
+
+   uint8_t *base;
+   if ((base = mmap(NULL, (pages + 1) * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+      err(EXIT_FAILURE, "mmap");
+
+   if (mprotect(base + pages * page, page, PROT_NONE) == -1)
+      err(EXIT_FAILURE, "mprotect");
+
+   return base + pages * page - size;
+}
+
+static bool
+check_kernel(const struct kernel *kernel, const uint32_t max_width)
+{
+   uint8_t *src = guarded((size_t)max_width * 4), *expected = guarded((size_t)max_width * 3), *got = guarded((size_t)max_width * 3);
+
+   for (uint32_t i = 0; i < max_width * 4; ++i)
+      src[i] = i * 131 + 7;
+
+   // Rows are placed at the end of the buffers, so each width ends at the guard page
+   for (uint32_t width = 1; width <= max_width; ++width) {
+      const uint8_t *row = src + (max_width - width) * 4;
+      uint8_t *a = expected + (max_width - width) * 3, *b = got + (max_width - width) * 3;
+      memset(b, 0xaa, width * 3);
+      pack_rgb_scalar(a, row, width);
+      kernel->fn(b, row, width);
+
+      if (memcmp(a, b, width * 3)) {
+         uint32_t x = 0;
+         while (!memcmp(a + x * 3, b + x * 3, 3))
+            ++x;
+
+         printf("%s: width %u differs from scalar at pixel %u\n", kernel->name, width, x);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Best of a few rounds, ns per frame
+static double
+time_frames(const struct kernel *kernel, uint8_t *dst, const uint8_t *src, const uint32_t width, const uint32_t height, const uint32_t frames)
+{
+   double best = 0;
+   for (int round = 0; round < 5; ++round) {
+      const uint64_t start = now_ns();
+      for (uint32_t i = 0; i < frames; ++i) {
+         if (kernel) {
+            for (uint32_t y = 0; y < height; ++y)
+               kernel->fn(dst + (size_t)y * width * 3, src + (size_t)y * width * 4, width);
+         } else {
+            copy_rows(dst, src, width, height, 4, 3, true);
+         }
+      }
+
+      const double ns = (double)(now_ns() - start) / frames;
+      best = (!round || ns < best ? ns : best);
+   }
+   return best;
+}
+
+int
+main(int argc, char *argv[])
+{
+   uint32_t max_width = 256, width = 1920, height = 1080, frames = 200;
+
+   for (int opt; (opt = getopt(argc, argv, "t:s:n:")) != -1;) {
+      switch (opt) {
+         case 't': max_width = strtoul(optarg, NULL, 10); break;
+         case 's':
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2)
+               width = 0;
+            break;
+         case 'n': frames = strtoul(optarg, NULL, 10); break;
+         default: width = 0; break;
+      }
+   }
+
+   if (optind != argc || !max_width || !width || !height || !frames) {
+      fprintf(stderr, "usage: %s [-t 256] [-s 1920x1080] [-n 200]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   bool ok = true;
+   for (size_t i = 1; i < ARRAY_SIZE(KERNELS); ++i) {
+      if (!kernel_supported(&KERNELS[i])) {
+         printf("%s: not supported by this cpu, skipped\n", KERNELS[i].name);
+         continue;
+      }
+
+      const bool passed = check_kernel(&KERNELS[i], max_width);
+      printf("%s: widths 1..%u %s\n", KERNELS[i].name, max_width, (passed ? "match scalar" : "FAILED"));
+      ok &= passed;
+   }
+
+   uint8_t *src, *dst;
+   if (!(src = malloc((size_t)width * height * 4)) || !(dst = malloc((size_t)width * height * 3)))
+      err(EXIT_FAILURE, "malloc");
+
+   memset(src, 0x55, (size_t)width * height * 4);
+   memset(dst, 0, (size_t)width * height * 3);
+
+   printf("%ux%u rgba -> rgb, best of 5 rounds of %u frames\n", width, height, frames);
+   printf("%-20s %10s %10s\n", "kernel", "ms/frame", "GiB/s");
+
+   const double bytes = (double)width * height * 4;
+   for (size_t i = 0; i <= ARRAY_SIZE(KERNELS); ++i) {
+      const struct kernel *kernel = (i < ARRAY_SIZE(KERNELS) ? &KERNELS[i] : NULL);
+      if (kernel && !kernel_supported(kernel))
+         continue;
+
+      const double ns = time_frames(kernel, dst, src, width, height, frames);
+      printf("%-20s %10.3f %10.2f\n", (kernel ? kernel->name : "copy_rows (flip)"), ns / 1e6, bytes / ns * 1e9 / (1024.0 * 1024.0 * 1024.0));
+   }
+
+   free(src);
+   free(dst);
+   return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+// Row conversion kernels for copying frames out of the PBO.
+// Only thing we do is RGBA -> RGB packing (drop alpha), everything else is plain memcpy.
+// Vector kernels may store past the pixels they convert, but never past the row (see the loop conditions).
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define PIXELS_X86 1
+#endif
+
+typedef void (*pack_row_fn)(uint8_t *restrict dst, const uint8_t *restrict src, const uint32_t width);
+
+static void
+pack_rgb_scalar(uint8_t *restrict dst, const uint8_t *restrict src, const uint32_t width)
+{
+   for (uint32_t x = 0; x < width; ++x, dst += 3, src += 4)
+      dst[0] = src[0], dst[1] = src[1], dst[2] = src[2];
+}
+
+#if PIXELS_X86
+__attribute__((target("ssse3"))) static void
+pack_rgb_ssse3(uint8_t *restrict dst, const uint8_t *restrict src, const uint32_t width)
+{
+   const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+   // 16 byte store writes 4 bytes past the 4 pixels, so leave at least 2 pixels after
+   uint32_t x = 0;
+   for (; x + 6 <= width; x += 4, dst += 12, src += 16)
+      _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), mask));
+
+   pack_rgb_scalar(dst, src, width - x);
+}
+
+__attribute__((target("avx2"))) static void
+pack_rgb_avx2(uint8_t *restrict dst, const uint8_t *restrict src, const uint32_t width)
+{
+   // Shuffle works per 128bit lane, so pack each lane to 12 bytes and then move lanes together
+   const __m256i mask = _mm256_setr_epi8(
+         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+   const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+   // 32 byte store writes 8 bytes past the 8 pixels, so leave at least 3 pixels after
+   uint32_t x = 0;
+   for (; x + 11 <= width; x += 8, dst += 24, src += 32) {
+      const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)src), mask);
+      _mm256_storeu_si256((__m256i*)dst, _mm256_permutevar8x32_epi32(v, lanes));
+   }
+
+   pack_rgb_ssse3(dst, src, width - x);
+}
+#endif
+
+static pack_row_fn
+get_pack_rgb(void)
+{
+   static pack_row_fn fn;
+
+   if (fn)
+      return fn;
+
+#if PIXELS_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      WARNX("using avx2 pixel packing");
+      return (fn = pack_rgb_avx2);
+   } else if (__builtin_cpu_supports("ssse3")) {
+      WARNX("using ssse3 pixel packing");
+      return (fn = pack_rgb_ssse3);
+   }
+#endif
+
+   // SSE2 has no byte shuffle, so for us it's no better than the scalar loop
+   return (fn = pack_rgb_scalar);
+}
+
+static void
+copy_rows(uint8_t *dst, const uint8_t *src, const uint32_t width, const uint32_t height, const uint8_t src_components, const uint8_t dst_components, const bool flip)
+{
+   const size_t src_stride = width * src_components, dst_stride = width * dst_components;
+
+   if (!flip && src_components == dst_components) {
+      memcpy(dst, src, dst_stride * height);
+      return;
+   }
+
+   // Flip and pack in one pass, so each pixel is touched only once
+   const uint8_t *row = (flip ? src + (height - 1) * src_stride : src);
+   const ptrdiff_t step = (flip ? -(ptrdiff_t)src_stride : (ptrdiff_t)src_stride);
+
+   if (src_components == dst_components) {
+      for (uint32_t y = 0; y < height; ++y, dst += dst_stride, row += step)
+         memcpy(dst, row, dst_stride);
+      return;
+   }
+
+   assert(src_components == 4 && dst_components == 3);
+   const pack_row_fn pack = get_pack_rgb();
+   for (uint32_t y = 0; y < height; ++y, dst += dst_stride, row += step)
+      pack(dst, row, width);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+/**
+ * Shared memory transport for the rawmux stream.
+ *
+ * Writer creates memfd, and links SHM_PATH to /proc/<pid>/fd/<memfd>.
+ * First page contains the control block below, rest of the memfd is a byte ring of records.
+ * Every record is a 8 byte record header followed by exactly the bytes that would go through the fifo,
+ * i.e. rawmux packet header + payload. Records never wrap, writer skips the end of the ring instead.
+ *
+ * Reader attaches by moving state from RAWSHM_WAITING to RAWSHM_ATTACHED.
+ * Writer then fills in the rawmux stream header and moves state to RAWSHM_STREAMING.
+ * RAWSHM_CLOSED means writer is gone, reader should drain what's left and stop.
+ *
+ * Futex words: state, written (bumped by writer on every record), consumed (bumped by reader on every record).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define RAWSHM_MAGIC "rawshm"
+#define RAWSHM_VERSION 1
+#define RAWSHM_RECORD_ALIGN 64
+
+enum rawshm_state {
+   RAWSHM_WAITING,
+   RAWSHM_ATTACHED,
+   RAWSHM_STREAMING,
+   RAWSHM_CLOSED,
+};
+
+enum rawshm_record {
+   RAWSHM_RECORD_PACKET,
+   RAWSHM_RECORD_SKIP,
+};
+
+struct rawshm {
+   char magic[8];
+   uint32_t version, state;
+   uint32_t written, consumed;
+   uint32_t reader, header_size;
+   uint64_t offset, size; // ring
+   uint64_t head, tail;
+   uint8_t header[256];
+};
+
+struct rawshm_record_header {
+   uint32_t type, size;
+};
+
+static inline uint64_t
+rawshm_record_size(const uint64_t size)
+{
+   return (sizeof(struct rawshm_record_header) + size + RAWSHM_RECORD_ALIGN - 1) & ~(uint64_t)(RAWSHM_RECORD_ALIGN - 1);
+}
+
+static inline uint32_t
+rawshm_load(const uint32_t *word)
+{
+   return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+rawshm_wake(uint32_t *word)
+{
+   // Not FUTEX_PRIVATE_FLAG, the other side lives in another process
+   syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static inline void
+rawshm_store(uint32_t *word, const uint32_t value)
+{
+   __atomic_store_n(word, value, __ATOMIC_RELEASE);
+   rawshm_wake(word);
+}
+
+static inline void
+rawshm_bump(uint32_t *word)
+{
+   __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+   rawshm_wake(word);
+}
+
+static inline void
+rawshm_wait(uint32_t *word, const uint32_t value, const uint32_t timeout_ms)
+{
+   const struct timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000 };
+   syscall(SYS_futex, word, FUTEX_WAIT, value, (timeout_ms ? &ts : NULL), NULL, 0);
+}
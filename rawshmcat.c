@@ -0,0 +1,158 @@
+/* gcc -std=c99 rawshmcat.c -o rawshmcat
+ *
+ * Reference reader for glcapture's shared memory transport (TRANSPORT_SHM)
+ * Writes the rawmux stream to stdout, so it can be used as drop-in for the fifo
+ * Usage: ./rawshmcat [/tmp/glcapture.shm] | ./ffplay -
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rawshm.h"
+
+static volatile sig_atomic_t STOP;
+
+static void
+stop(int sig)
+{
+   (void)sig;
+   STOP = true;
+}
+
+static bool
+write_all(const void *data, const size_t size)
+{
+   for (size_t off = 0; off < size;) {
+      const ssize_t ret = write(STDOUT_FILENO, (const uint8_t*)data + off, size - off);
+
+      if (ret < 0 && errno == EINTR)
+         continue;
+
+      if (ret <= 0)
+         return false;
+
+      off += ret;
+   }
+
+   return true;
+}
+
+static pid_t
+writer_pid(const char *path)
+{
+   // Writer links the path to its /proc/<pid>/fd/<memfd>
+   char target[64] = {0};
+   pid_t pid = 0;
+   if (readlink(path, target, sizeof(target) - 1) > 0)
+      sscanf(target, "/proc/%d/", &pid);
+   return pid;
+}
+
+static bool
+writer_alive(const pid_t pid)
+{
+   return (!pid || kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+static struct rawshm*
+attach(const char *path, size_t *out_size, pid_t *out_writer)
+{
+   int fd;
+   struct stat st;
+   while ((*out_writer = writer_pid(path), fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+      if (STOP)
+         exit(EXIT_FAILURE);
+
+      // Writer creates the ring lazily, wait for it
+      usleep(100 * 1000);
+   }
+
+   if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct rawshm))
+      errx(EXIT_FAILURE, "%s: not a rawshm ring", path);
+
+   struct rawshm *shm;
+   if ((shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      err(EXIT_FAILURE, "mmap(%s)", path);
+
+   close(fd);
+
+   if (memcmp(shm->magic, RAWSHM_MAGIC, sizeof(RAWSHM_MAGIC)) || shm->version != RAWSHM_VERSION)
+      errx(EXIT_FAILURE, "%s: not a rawshm ring or version mismatch", path);
+
+   shm->reader = getpid();
+   if (!__atomic_compare_exchange_n(&shm->state, (uint32_t[]){RAWSHM_WAITING}, RAWSHM_ATTACHED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      errx(EXIT_FAILURE, "%s: already has a reader", path);
+
+   rawshm_wake(&shm->state);
+   *out_size = st.st_size;
+   return shm;
+}
+
+int
+main(int argc, char *argv[])
+{
+   const char *path = (argc > 1 ? argv[1] : "/tmp/glcapture.shm");
+   signal(SIGPIPE, SIG_IGN);
+   signal(SIGINT, stop);
+   signal(SIGTERM, stop);
+
+   size_t size;
+   pid_t writer;
+   struct rawshm *shm = attach(path, &size, &writer);
+
+   uint32_t state;
+   while (!STOP && (state = rawshm_load(&shm->state)) == RAWSHM_ATTACHED && writer_alive(writer))
+      rawshm_wait(&shm->state, state, 100);
+
+   if (STOP || shm->state != RAWSHM_STREAMING || !write_all(shm->header, shm->header_size))
+      goto out;
+
+   const uint8_t *ring = (const uint8_t*)shm + shm->offset;
+
+   while (!STOP) {
+      const uint32_t written = rawshm_load(&shm->written);
+      const uint64_t tail = shm->tail;
+
+      if (tail == __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE)) {
+         // Writer is gone and we've drained everything it wrote
+         // Writer that exited without closing the ring is noticed by its pid disappearing
+         if (rawshm_load(&shm->state) == RAWSHM_CLOSED || !writer_alive(writer)) {
+            if (tail == __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE))
+               break;
+            continue;
+         }
+
+         rawshm_wait(&shm->written, written, 100);
+         continue;
+      }
+
+      // Records are contiguous, so the packet can be consumed straight from the mapping
+      const uint64_t pos = tail % shm->size;
+      struct rawshm_record_header record;
+      memcpy(&record, ring + pos, sizeof(record));
+
+      uint64_t advance = shm->size - pos;
+      if (record.type == RAWSHM_RECORD_PACKET) {
+         if (!write_all(ring + pos + sizeof(record), record.size))
+            break;
+
+         advance = rawshm_record_size(record.size);
+      }
+
+      __atomic_store_n(&shm->tail, tail + advance, __ATOMIC_RELEASE);
+      rawshm_bump(&shm->consumed);
+   }
+
+out:
+   shm->reader = 0;
+   rawshm_wake(&shm->consumed);
+   munmap(shm, size);
+   return EXIT_SUCCESS;
+}
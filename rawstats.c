@@ -0,0 +1,120 @@
+/* gcc -std=c99 rawstats.c -o rawstats
+ *
+ * Reader for glcapture's stats page (STATS_PATH, see rawstats.h)
+ * Prints the per stage timings and the counters of the last second, every second, until glcapture exits
+ * With -1 it prints the totals since glcapture started once instead, the page goes away with the process
+ * Usage: ./rawstats [-1] [/tmp/glcapture.stats]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "rawstats.h"
+
+static bool
+writer_alive(const pid_t pid)
+{
+   return (pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH));
+}
+
+static uint64_t
+now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Quantiles are bucket edges, which can be past the real max
+static double
+quantile_us(const uint64_t bucket[RAWSTATS_BUCKETS], const double q, const uint64_t max)
+{
+   const uint64_t ns = rawstats_quantile(bucket, q);
+   return (ns < max ? ns : max) / 1e3;
+}
+
+static void
+print_stats(const struct rawstats *now, const struct rawstats *last, const double seconds)
+{
+   printf("%-14s %9s %9s %9s %9s %9s %9s %9s\n", "stage (us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+   for (enum rawstats_stage i = 0; i < RAWSTATS_STAGES; ++i) {
+      const struct rawstats_histogram *a = &now->stage[i], *b = &last->stage[i];
+      const uint64_t count = a->count - b->count;
+
+      if (!count)
+         continue;
+
+      uint64_t bucket[RAWSTATS_BUCKETS];
+      for (uint32_t j = 0; j < RAWSTATS_BUCKETS; ++j)
+         bucket[j] = a->bucket[j] - b->bucket[j];
+
+      // Max can't be diffed, it's the max since start
+      printf("%-14s %9llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", rawstats_stage_name(i), (unsigned long long)count,
+             (double)(a->sum - b->sum) / count / 1e3, quantile_us(bucket, 0.5, a->max), quantile_us(bucket, 0.9, a->max),
+             quantile_us(bucket, 0.99, a->max), quantile_us(bucket, 0.999, a->max), a->max / 1e3);
+   }
+
+   printf("%-16s %11s %9s\n", "counter", "total", "per sec");
+   for (enum rawstats_counter i = 0; i < RAWSTATS_COUNTERS; ++i) {
+      printf("%-16s %11llu %9.1f\n", rawstats_counter_name(i), (unsigned long long)now->counter[i],
+             (now->counter[i] - last->counter[i]) / seconds);
+   }
+
+   printf("\n");
+   fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+   const bool once = (argc > 1 && !strcmp(argv[1], "-1"));
+   const char *path = (argc > 1 + once ? argv[1 + once] : "/tmp/glcapture.stats");
+
+   if (argc > 2 + once) {
+      fprintf(stderr, "usage: %s [-1] [/tmp/glcapture.stats]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   int fd;
+   const struct rawstats *stats;
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      err(EXIT_FAILURE, "open(%s)", path);
+
+   if ((stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      err(EXIT_FAILURE, "mmap");
+
+   if (memcmp(stats->magic, RAWSTATS_MAGIC, sizeof(stats->magic)) || stats->version != RAWSTATS_VERSION)
+      errx(EXIT_FAILURE, "%s is not a glcapture stats page (or a different version)", path);
+
+   // Page is only ever added to, so a plain copy is a good enough snapshot
+   struct rawstats last = {0}, now;
+   memcpy(&now, stats, sizeof(now));
+
+   if (once) {
+      print_stats(&now, &last, (now_ns() - now.started) / 1e9);
+      return EXIT_SUCCESS;
+   }
+
+   const pid_t pid = stats->pid;
+   last = now;
+
+   for (uint64_t at = now_ns(), prev; writer_alive(pid); last = now) {
+      sleep(1);
+      memcpy(&now, stats, sizeof(now));
+      prev = at, at = now_ns();
+      print_stats(&now, &last, (at - prev) / 1e9);
+   }
+
+   warnx("glcapture (pid %d) is gone", pid);
+   return EXIT_SUCCESS;
+}
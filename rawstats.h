@@ -0,0 +1,164 @@
+#pragma once
+
+/**
+ * Shared memory stats page of glcapture.
+ *
+ * Writer creates memfd, and links STATS_PATH to /proc/<pid>/fd/<memfd>, same as the rawshm transport.
+ * Page is a single struct rawstats, written with relaxed atomics and never reset, readers diff snapshots for rates.
+ *
+ * Every stage keeps a histogram of how long it took, in ns. Buckets are log-linear like HdrHistogram's:
+ * RAWSTATS_SUB buckets per power of two, so a bucket is never wider than 1/RAWSTATS_SUB of the values in it.
+ * Values past the last bucket (~17s) land in the last bucket, max still has the real value.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RAWSTATS_MAGIC "rawstats"
+#define RAWSTATS_VERSION 1
+#define RAWSTATS_SUB_BITS 3
+#define RAWSTATS_SUB (1 << RAWSTATS_SUB_BITS)
+#define RAWSTATS_BUCKETS 256
+
+enum rawstats_stage {
+   RAWSTATS_SWAP, // whole swap_buffers hook, i.e. what the game pays per frame
+   RAWSTATS_CAPTURE,
+   RAWSTATS_READBACK, // cpu side of issuing the glReadPixels
+   RAWSTATS_GPU_READBACK, // GL_TIME_ELAPSED of the glReadPixels, when the driver has timer queries
+   RAWSTATS_COLLECT, // waiting for finished readbacks
+   RAWSTATS_MAP,
+   RAWSTATS_FLIP, // copying a mapped frame out to its packet
+   RAWSTATS_INDICATOR,
+   RAWSTATS_LOCK_WAIT, // producer queue locks
+   RAWSTATS_LOCKSTEP_WAIT,
+   RAWSTATS_AUDIO,
+   RAWSTATS_MUX, // time packets sit in the queues before the mux thread writes them
+   RAWSTATS_WRITE,
+   RAWSTATS_STAGES,
+};
+
+enum rawstats_counter {
+   RAWSTATS_FRAMES, // submitted to the mux
+   RAWSTATS_FRAMES_DROPPED, // by the frame rate limit
+   RAWSTATS_FRAMES_MISSED, // no free pbo, readbacks didn't keep up
+   RAWSTATS_PACKETS, // written out
+   RAWSTATS_PACKETS_DROPPED, // full queue, or too big for the shm ring
+   RAWSTATS_PACKETS_SKIPPED, // stale video skipped by the mux
+   RAWSTATS_BYTES, // written out
+   RAWSTATS_AUDIO_FRAMES,
+   RAWSTATS_COUNTERS,
+};
+
+struct rawstats_histogram {
+   uint64_t count, sum, max; // ns
+   uint64_t bucket[RAWSTATS_BUCKETS];
+};
+
+struct rawstats {
+   char magic[8];
+   uint32_t version, pid;
+   uint64_t started; // CLOCK_MONOTONIC ns
+   uint64_t counter[RAWSTATS_COUNTERS];
+   struct rawstats_histogram stage[RAWSTATS_STAGES];
+};
+
+static inline const char*
+rawstats_stage_name(const enum rawstats_stage stage)
+{
+   switch (stage) {
+      case RAWSTATS_SWAP: return "swap";
+      case RAWSTATS_CAPTURE: return "capture";
+      case RAWSTATS_READBACK: return "readback";
+      case RAWSTATS_GPU_READBACK: return "gpu readback";
+      case RAWSTATS_COLLECT: return "collect";
+      case RAWSTATS_MAP: return "map";
+      case RAWSTATS_FLIP: return "flip";
+      case RAWSTATS_INDICATOR: return "indicator";
+      case RAWSTATS_LOCK_WAIT: return "lock wait";
+      case RAWSTATS_LOCKSTEP_WAIT: return "lockstep wait";
+      case RAWSTATS_AUDIO: return "audio";
+      case RAWSTATS_MUX: return "mux";
+      case RAWSTATS_WRITE: return "write";
+      case RAWSTATS_STAGES: break;
+   }
+   return "unknown";
+}
+
+static inline const char*
+rawstats_counter_name(const enum rawstats_counter counter)
+{
+   switch (counter) {
+      case RAWSTATS_FRAMES: return "frames";
+      case RAWSTATS_FRAMES_DROPPED: return "frames dropped";
+      case RAWSTATS_FRAMES_MISSED: return "frames missed";
+      case RAWSTATS_PACKETS: return "packets";
+      case RAWSTATS_PACKETS_DROPPED: return "packets dropped";
+      case RAWSTATS_PACKETS_SKIPPED: return "packets skipped";
+      case RAWSTATS_BYTES: return "bytes";
+      case RAWSTATS_AUDIO_FRAMES: return "audio frames";
+      case RAWSTATS_COUNTERS: break;
+   }
+   return "unknown";
+}
+
+static inline uint32_t
+rawstats_bucket(const uint64_t ns)
+{
+   if (ns < RAWSTATS_SUB)
+      return ns;
+
+   const uint32_t msb = 63 - __builtin_clzll(ns);
+   const uint32_t index = ((msb - RAWSTATS_SUB_BITS + 1) << RAWSTATS_SUB_BITS) + ((ns >> (msb - RAWSTATS_SUB_BITS)) & (RAWSTATS_SUB - 1));
+   return (index < RAWSTATS_BUCKETS ? index : RAWSTATS_BUCKETS - 1);
+}
+
+// Lowest value that lands in the bucket
+static inline uint64_t
+rawstats_bucket_value(const uint32_t bucket)
+{
+   if (bucket < RAWSTATS_SUB)
+      return bucket;
+
+   const uint32_t msb = (bucket >> RAWSTATS_SUB_BITS) + RAWSTATS_SUB_BITS - 1;
+   return (uint64_t)(RAWSTATS_SUB + (bucket & (RAWSTATS_SUB - 1))) << (msb - RAWSTATS_SUB_BITS);
+}
+
+static inline void
+rawstats_add(uint64_t *value, const uint64_t add)
+{
+   __atomic_add_fetch(value, add, __ATOMIC_RELAXED);
+}
+
+static inline void
+rawstats_record(struct rawstats_histogram *histogram, const uint64_t ns)
+{
+   rawstats_add(&histogram->bucket[rawstats_bucket(ns)], 1);
+   rawstats_add(&histogram->sum, ns);
+   rawstats_add(&histogram->count, 1);
+
+   for (uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED); ns > max;) {
+      if (__atomic_compare_exchange_n(&histogram->max, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         break;
+   }
+}
+
+// Value at quantile q (0..1) of the histogram's buckets, as the upper edge of the bucket it falls into
+static inline uint64_t
+rawstats_quantile(const uint64_t bucket[RAWSTATS_BUCKETS], const double q)
+{
+   uint64_t count = 0;
+   for (uint32_t i = 0; i < RAWSTATS_BUCKETS; ++i)
+      count += bucket[i];
+
+   if (!count)
+      return 0;
+
+   const uint64_t rank = (uint64_t)(q * (count - 1)) + 1;
+   uint64_t seen = 0;
+   for (uint32_t i = 0; i < RAWSTATS_BUCKETS; ++i) {
+      if ((seen += bucket[i]) >= rank)
+         return (i + 1 < RAWSTATS_BUCKETS ? rawstats_bucket_value(i + 1) - 1 : rawstats_bucket_value(i));
+   }
+
+   return rawstats_bucket_value(RAWSTATS_BUCKETS - 1);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+/**
+ * Lossless stripe compression for the rawmux video stream.
+ *
+ * Compressed video is announced in the rawmux header with RAWSTRIPE_FORMAT instead of "rgb".
+ * Each frame is split into horizontal stripes that are compressed independently, and every stripe
+ * is its own rawmux packet of the video stream. All stripes of a frame share the pts and are written
+ * back to back in order. Packet payload is rawstripe_header followed by the compressed rows.
+ *
+ * Codec is QOI (https://qoiformat.org) without the file header and end marker, restricted to RGB.
+ * Encoder state (previous pixel, index) starts fresh for every stripe, so stripes can be encoded
+ * and decoded in parallel.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define RAWSTRIPE_FORMAT "rgb+qoi"
+#define RAWSTRIPE_MAX 64
+
+struct rawstripe_header {
+   uint16_t index, count;
+   uint32_t y, rows; // position of the stripe in the frame
+};
+
+enum {
+   RAWSTRIPE_OP_INDEX = 0x00, // 00xxxxxx
+   RAWSTRIPE_OP_DIFF = 0x40, // 01xxxxxx
+   RAWSTRIPE_OP_LUMA = 0x80, // 10xxxxxx
+   RAWSTRIPE_OP_RUN = 0xc0, // 11xxxxxx
+   RAWSTRIPE_OP_RGB = 0xfe,
+   RAWSTRIPE_MASK = 0xc0,
+};
+
+static inline uint32_t
+rawstripe_hash(const uint8_t px[4])
+{
+   return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+}
+
+// Worst case is a RAWSTRIPE_OP_RGB for every pixel
+static inline uint64_t
+rawstripe_bound(const uint32_t width, const uint32_t rows)
+{
+   return (uint64_t)width * rows * 4;
+}
+
+// Compresses rows of tightly packed rgb, dst must hold rawstripe_bound bytes
+static inline uint64_t
+rawstripe_encode(uint8_t *restrict dst, const uint8_t *restrict src, const uint32_t width, const uint32_t rows)
+{
+   uint8_t index[64][4] = {{0}}, prev[4] = { 0, 0, 0, 255 };
+   uint8_t *d = dst;
+   uint32_t run = 0;
+
+   const uint8_t *end = src + (uint64_t)width * rows * 3;
+   for (const uint8_t *s = src; s < end; s += 3) {
+      const uint8_t px[4] = { s[0], s[1], s[2], 255 };
+
+      if (!memcmp(px, prev, 4)) {
+         if (++run == 62) {
+            *d++ = RAWSTRIPE_OP_RUN | (run - 1);
+            run = 0;
+         }
+         continue;
+      }
+
+      if (run) {
+         *d++ = RAWSTRIPE_OP_RUN | (run - 1);
+         run = 0;
+      }
+
+      const uint32_t hash = rawstripe_hash(px);
+      if (!memcmp(index[hash], px, 4)) {
+         *d++ = RAWSTRIPE_OP_INDEX | hash;
+      } else {
+         memcpy(index[hash], px, 4);
+
+         const int8_t vr = px[0] - prev[0], vg = px[1] - prev[1], vb = px[2] - prev[2];
+         const int8_t vg_r = vr - vg, vg_b = vb - vg;
+
+         if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+            *d++ = RAWSTRIPE_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+         } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+            *d++ = RAWSTRIPE_OP_LUMA | (vg + 32);
+            *d++ = (vg_r + 8) << 4 | (vg_b + 8);
+         } else {
+            *d++ = RAWSTRIPE_OP_RGB;
+            *d++ = px[0], *d++ = px[1], *d++ = px[2];
+         }
+      }
+
+      memcpy(prev, px, 4);
+   }
+
+   if (run)
+      *d++ = RAWSTRIPE_OP_RUN | (run - 1);
+
+   return d - dst;
+}
+
+// Decompresses into rows of tightly packed rgb, false if the data doesn't decode to exactly width * rows pixels
+static inline bool
+rawstripe_decode(uint8_t *restrict dst, const uint8_t *restrict src, const uint64_t size, const uint32_t width, const uint32_t rows)
+{
+   uint8_t index[64][4] = {{0}}, px[4] = { 0, 0, 0, 255 };
+   const uint8_t *s = src, *send = src + size;
+   uint8_t *d = dst, *dend = dst + (uint64_t)width * rows * 3;
+
+   while (s < send) {
+      const uint8_t op = *s++;
+      uint32_t run = 1;
+
+      if (op == RAWSTRIPE_OP_RGB) {
+         if (send - s < 3)
+            return false;
+         px[0] = s[0], px[1] = s[1], px[2] = s[2];
+         s += 3;
+      } else if ((op & RAWSTRIPE_MASK) == RAWSTRIPE_OP_INDEX) {
+         memcpy(px, index[op], 4);
+      } else if ((op & RAWSTRIPE_MASK) == RAWSTRIPE_OP_DIFF) {
+         px[0] += ((op >> 4) & 3) - 2;
+         px[1] += ((op >> 2) & 3) - 2;
+         px[2] += (op & 3) - 2;
+      } else if ((op & RAWSTRIPE_MASK) == RAWSTRIPE_OP_LUMA) {
+         if (s >= send)
+            return false;
+         const int vg = (op & 0x3f) - 32;
+         px[0] += vg - 8 + ((*s >> 4) & 0xf);
+         px[1] += vg;
+         px[2] += vg - 8 + (*s & 0xf);
+         s++;
+      } else if (op != 0xff) {
+         run = (op & 0x3f) + 1;
+      } else {
+         return false; // QOI_OP_RGBA, there's no alpha
+      }
+
+      memcpy(index[rawstripe_hash(px)], px, 4);
+
+      if ((uint64_t)(dend - d) < run * 3)
+         return false;
+
+      for (; run; --run, d += 3)
+         d[0] = px[0], d[1] = px[1], d[2] = px[2];
+   }
+
+   return (d == dend);
+}
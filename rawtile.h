@@ -0,0 +1,237 @@
+#pragma once
+
+/**
+ * Dirty tile delta encoding for the rawmux video stream.
+ *
+ * Delta video is announced in the rawmux header with RAWTILE_FORMAT instead of "rgb".
+ * Every video packet payload starts with rawtile_header, and its kind tells what follows:
+ * RAWTILE_KEY: the whole rgb frame.
+ * RAWTILE_DELTA: count tiles that changed since the previous frame, each is rawtile_pos followed by the tile's rgb rows.
+ *                Tiles on the right and bottom edges are cropped to the frame.
+ * RAWTILE_REPEAT: nothing, frame is identical to the previous one.
+ *
+ * Encoder finds changed tiles by comparing 64bit hashes of the tiles against the previous frame's,
+ * so it only needs to keep the hashes around, not the previous frame.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#  define RAWTILE_X86 1
+#endif
+
+#define RAWTILE_FORMAT "rgb+tiles"
+#define RAWTILE_MAX_COLUMNS 1024
+
+enum rawtile_kind {
+   RAWTILE_KEY,
+   RAWTILE_DELTA,
+   RAWTILE_REPEAT,
+};
+
+struct rawtile_header {
+   uint8_t kind;
+   uint8_t pad;
+   uint16_t tile; // width and height of the tiles in pixels
+   uint32_t count; // tiles in the packet
+};
+
+struct rawtile_pos {
+   uint16_t x, y; // in tiles
+};
+
+typedef uint64_t (*rawtile_hash_fn)(const uint64_t hash, const uint8_t *data, const size_t size);
+
+static inline uint64_t
+rawtile_hash_scalar(const uint64_t hash, const uint8_t *data, const size_t size)
+{
+   uint64_t h = hash;
+   size_t i = 0;
+   for (uint64_t w; i + 8 <= size; i += 8) {
+      memcpy(&w, data + i, sizeof(w));
+      h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 29;
+   }
+
+   for (; i < size; ++i)
+      h = (h ^ data[i]) * 0x100000001b3ull;
+
+   return h;
+}
+
+#if RAWTILE_X86
+// Two independent crc32c chains give 64 bits of hash, and keep two crc units busy
+__attribute__((target("sse4.2"))) static inline uint64_t
+rawtile_hash_sse42(const uint64_t hash, const uint8_t *data, const size_t size)
+{
+   uint64_t c0 = (uint32_t)hash, c1 = hash >> 32;
+   size_t i = 0;
+   for (uint64_t a, b; i + 16 <= size; i += 16) {
+      memcpy(&a, data + i, sizeof(a));
+      memcpy(&b, data + i + 8, sizeof(b));
+      c0 = _mm_crc32_u64(c0, a);
+      c1 = _mm_crc32_u64(c1, b);
+   }
+
+   for (; i < size; ++i)
+      c0 = _mm_crc32_u8(c0, data[i]);
+
+   return (c1 << 32) | (uint32_t)c0;
+}
+#endif
+
+static inline rawtile_hash_fn
+rawtile_get_hash(void)
+{
+   static rawtile_hash_fn fn;
+
+   if (fn)
+      return fn;
+
+#if RAWTILE_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("sse4.2"))
+      return (fn = rawtile_hash_sse42);
+#endif
+
+   return (fn = rawtile_hash_scalar);
+}
+
+static inline uint32_t
+rawtile_columns(const uint32_t width, const uint32_t tile)
+{
+   return (width + tile - 1) / tile;
+}
+
+static inline uint32_t
+rawtile_count(const uint32_t width, const uint32_t height, const uint32_t tile)
+{
+   return rawtile_columns(width, tile) * ((height + tile - 1) / tile);
+}
+
+// Worst case is a delta where every tile changed
+static inline uint64_t
+rawtile_bound(const uint32_t width, const uint32_t height, const uint32_t tile)
+{
+   return sizeof(struct rawtile_header) + (uint64_t)rawtile_count(width, height, tile) * sizeof(struct rawtile_pos) + (uint64_t)width * height * 3;
+}
+
+// Encodes a tightly packed rgb frame against the previous one, described by hash (rawtile_count entries)
+// Hash is updated to describe this frame, key ignores it and encodes the whole frame
+// Width must not be more than RAWTILE_MAX_COLUMNS tiles, dst must hold rawtile_bound bytes
+static inline uint64_t
+rawtile_encode(uint8_t *restrict dst, const uint8_t *restrict src, const uint32_t width, const uint32_t height, const uint32_t tile, uint64_t *restrict hash, const bool key)
+{
+   const rawtile_hash_fn hash_fn = rawtile_get_hash();
+   const uint32_t columns = rawtile_columns(width, tile);
+   const size_t stride = (size_t)width * 3;
+   uint8_t *d = dst + sizeof(struct rawtile_header);
+   uint32_t count = 0;
+
+   // Hash a row of tiles at a time, and copy out the changed ones while they're still in cache
+   for (uint32_t ty = 0, y = 0; y < height; ++ty, y += tile) {
+      const uint32_t rows = (tile < height - y ? tile : height - y);
+      uint64_t current[RAWTILE_MAX_COLUMNS];
+
+      for (uint32_t tx = 0; tx < columns; ++tx)
+         current[tx] = ~(uint64_t)0;
+
+      for (uint32_t r = 0; r < rows; ++r) {
+         const uint8_t *row = src + (y + r) * stride;
+         for (uint32_t tx = 0, x = 0; tx < columns; ++tx, x += tile)
+            current[tx] = hash_fn(current[tx], row + (size_t)x * 3, (size_t)(tile < width - x ? tile : width - x) * 3);
+      }
+
+      for (uint32_t tx = 0, x = 0; tx < columns; ++tx, x += tile) {
+         uint64_t *prev = &hash[ty * columns + tx];
+
+         if (!key && *prev == current[tx])
+            continue;
+
+         *prev = current[tx];
+
+         if (key)
+            continue;
+
+         const size_t span = (size_t)(tile < width - x ? tile : width - x) * 3;
+         memcpy(d, &(struct rawtile_pos){ .x = tx, .y = ty }, sizeof(struct rawtile_pos));
+         d += sizeof(struct rawtile_pos);
+
+         for (uint32_t r = 0; r < rows; ++r, d += span)
+            memcpy(d, src + (y + r) * stride + (size_t)x * 3, span);
+
+         count++;
+      }
+   }
+
+   if (key) {
+      memcpy(d, src, stride * height);
+      d += stride * height;
+   }
+
+   const struct rawtile_header header = {
+      .kind = (key ? RAWTILE_KEY : (count ? RAWTILE_DELTA : RAWTILE_REPEAT)),
+      .tile = tile,
+      .count = (key ? 0 : count),
+   };
+
+   memcpy(dst, &header, sizeof(header));
+   return d - dst;
+}
+
+// Applies a packet to the previous frame in dst, false if the packet is malformed
+// Delta and repeat need a previous frame, have_key tells whether there is one
+static inline bool
+rawtile_decode(uint8_t *restrict dst, const uint8_t *restrict src, const uint64_t size, const uint32_t width, const uint32_t height, const bool have_key)
+{
+   struct rawtile_header header;
+   if (size < sizeof(header))
+      return false;
+
+   memcpy(&header, src, sizeof(header));
+   const size_t stride = (size_t)width * 3;
+   const uint8_t *s = src + sizeof(header), *send = src + size;
+
+   if (header.kind == RAWTILE_KEY) {
+      if ((uint64_t)(send - s) != stride * height)
+         return false;
+
+      memcpy(dst, s, stride * height);
+      return true;
+   }
+
+   if (!have_key || !header.tile)
+      return false;
+
+   if (header.kind == RAWTILE_REPEAT)
+      return (s == send);
+
+   if (header.kind != RAWTILE_DELTA)
+      return false;
+
+   for (uint32_t i = 0; i < header.count; ++i) {
+      struct rawtile_pos pos;
+      if ((uint64_t)(send - s) < sizeof(pos))
+         return false;
+
+      memcpy(&pos, s, sizeof(pos));
+      s += sizeof(pos);
+
+      const uint32_t x = pos.x * header.tile, y = pos.y * header.tile;
+      if (x >= width || y >= height)
+         return false;
+
+      const size_t span = (size_t)(header.tile < width - x ? header.tile : width - x) * 3;
+      const uint32_t rows = (header.tile < height - y ? header.tile : height - y);
+      if ((uint64_t)(send - s) < span * rows)
+         return false;
+
+      for (uint32_t r = 0; r < rows; ++r, s += span)
+         memcpy(dst + (y + r) * stride + (size_t)x * 3, s, span);
+   }
+
+   return (s == send);
+}
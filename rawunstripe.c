@@ -0,0 +1,325 @@
+/* gcc -std=c99 -O2 rawunstripe.c -o rawunstripe
+ *
+ * Reference decoder for glcapture's compressed video (COMPRESS_THREADS, see rawstripe.h)
+ * Turns the rawmux stream back to plain rgb video, so ffmpeg's rawmux demuxer can read it
+ * Usage: ./rawunstripe < /tmp/glcapture.fifo | ./ffplay -
+ *
+ * With -b it instead benchmarks the codec on the video frames of a capture (compressed or not)
+ * Usage: ./rawunstripe -b < capture.rawmux
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "rawstripe.h"
+
+struct video {
+   int stream; // packet stream id, -1 if there's no video
+   uint32_t width, height;
+   bool compressed;
+};
+
+struct frame {
+   uint8_t *data;
+   uint64_t pts, have; // have is a bitmask of decoded stripes
+   uint32_t count;
+};
+
+struct bench {
+   uint64_t frames, raw, packed;
+   double encode, decode; // cpu seconds
+};
+
+// Packet with a new rawmux header as payload, packets after it follow the new header (glcapture's RECONFIGURE_PACKETS)
+#define RAWMUX_RECONFIGURE 0xff
+
+static bool
+read_all(void *data, const size_t size, FILE *in)
+{
+   return fread(data, 1, size, in) == size;
+}
+
+static void
+write_all(const void *data, const size_t size)
+{
+   if (fwrite(data, 1, size, stdout) != size)
+      err(EXIT_FAILURE, "write");
+}
+
+static double
+cpu_time(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+read_string(uint8_t *out, const size_t max, FILE *in)
+{
+   size_t i = 0;
+   for (int c; i < max && (c = fgetc(in)) != EOF;) {
+      out[i++] = c;
+      if (!c)
+         return i;
+   }
+   errx(EXIT_FAILURE, "bad rawmux header");
+}
+
+static size_t
+read_header(uint8_t header[255], struct video *video, FILE *in)
+{
+   // Same header out, just with the plain video format
+   if (!read_all(header, 7, in) || memcmp(header, "rawmux", 6) || header[6] != 1)
+      errx(EXIT_FAILURE, "not a rawmux stream");
+
+   size_t size = 7;
+   *video = (struct video){ .stream = -1 };
+
+   for (int stream = 0;; ++stream) {
+      uint8_t type;
+      if (!read_all(&type, 1, in))
+         errx(EXIT_FAILURE, "bad rawmux header");
+
+      header[size++] = type;
+
+      if (!type)
+         return size;
+
+      uint8_t format[64];
+      const size_t len = read_string(format, sizeof(format), in);
+
+      if (type == 1) {
+         uint32_t fields[4];
+         if (!read_all(fields, sizeof(fields), in))
+            errx(EXIT_FAILURE, "bad rawmux header");
+
+         video->stream = stream;
+         video->width = fields[2];
+         video->height = fields[3];
+         video->compressed = !strcmp((char*)format, RAWSTRIPE_FORMAT);
+
+         const char *plain = (video->compressed ? "rgb" : (char*)format);
+         memcpy(header + size, plain, strlen(plain) + 1); size += strlen(plain) + 1;
+         memcpy(header + size, fields, sizeof(fields)); size += sizeof(fields);
+      } else if (type == 2) {
+         memcpy(header + size, format, len); size += len;
+         if (!read_all(header + size, 5, in))
+            errx(EXIT_FAILURE, "bad rawmux header");
+         size += 5;
+      } else {
+         errx(EXIT_FAILURE, "unknown rawmux stream type %u", type);
+      }
+
+      if (size + 64 > 255)
+         errx(EXIT_FAILURE, "bad rawmux header");
+   }
+}
+
+static void
+write_frame(const struct video *video, const struct frame *frame)
+{
+   const uint32_t size = video->width * video->height * 3;
+   uint8_t packet[13] = { video->stream };
+   memcpy(packet + 1, &size, sizeof(size));
+   memcpy(packet + 1 + 4, &frame->pts, sizeof(frame->pts));
+   write_all(packet, sizeof(packet));
+   write_all(frame->data, size);
+}
+
+// Returns true when the packet completed a frame
+static bool
+decode_stripe(const struct video *video, struct frame *frame, const uint64_t pts, const uint8_t *data, const uint32_t size)
+{
+   struct rawstripe_header header;
+   if (size < sizeof(header))
+      errx(EXIT_FAILURE, "truncated stripe");
+
+   memcpy(&header, data, sizeof(header));
+
+   if (!header.count || header.count > RAWSTRIPE_MAX || header.index >= header.count ||
+       header.y > video->height || header.rows > video->height - header.y)
+      errx(EXIT_FAILURE, "bad stripe %u/%u", header.index, header.count);
+
+   // Writer may have been interrupted in the middle of a frame
+   if (frame->have && (frame->pts != pts || frame->count != header.count)) {
+      warnx("dropping incomplete frame (pts %llu)", (unsigned long long)frame->pts);
+      frame->have = 0;
+   }
+
+   frame->pts = pts;
+   frame->count = header.count;
+
+   if (!rawstripe_decode(frame->data + (uint64_t)header.y * video->width * 3, data + sizeof(header), size - sizeof(header), video->width, header.rows))
+      errx(EXIT_FAILURE, "corrupted stripe %u/%u", header.index, header.count);
+
+   frame->have |= (uint64_t)1 << header.index;
+
+   if (frame->have != (header.count == 64 ? ~(uint64_t)0 : ((uint64_t)1 << header.count) - 1))
+      return false;
+
+   frame->have = 0;
+   return true;
+}
+
+static void
+bench_frame(const struct video *video, const uint8_t *rgb, uint8_t *packed, uint8_t *check, struct bench *bench)
+{
+   // Same split as glcapture's COMPRESS_STRIPES default
+   const uint32_t stripes = 8, width = video->width;
+   const uint32_t rows = (video->height + stripes - 1) / stripes;
+   uint64_t sizes[RAWSTRIPE_MAX], offset = 0;
+
+   double start = cpu_time();
+   for (uint32_t y = 0, i = 0; y < video->height; y += rows, ++i) {
+      const uint32_t n = (rows < video->height - y ? rows : video->height - y);
+      sizes[i] = rawstripe_encode(packed + offset, rgb + (uint64_t)y * width * 3, width, n);
+      offset += sizes[i];
+   }
+   bench->encode += cpu_time() - start;
+
+   start = cpu_time();
+   offset = 0;
+   for (uint32_t y = 0, i = 0; y < video->height; y += rows, ++i) {
+      const uint32_t n = (rows < video->height - y ? rows : video->height - y);
+      if (!rawstripe_decode(check + (uint64_t)y * width * 3, packed + offset, sizes[i], width, n))
+         errx(EXIT_FAILURE, "benchmark: failed to decode what was encoded");
+      offset += sizes[i];
+   }
+   bench->decode += cpu_time() - start;
+
+   if (memcmp(rgb, check, (uint64_t)width * video->height * 3))
+      errx(EXIT_FAILURE, "benchmark: round trip mismatch");
+
+   bench->frames++;
+   bench->raw += (uint64_t)width * video->height * 3;
+   bench->packed += offset;
+}
+
+static void
+report(const struct bench *bench)
+{
+   if (!bench->frames)
+      errx(EXIT_FAILURE, "no rgb video frames to benchmark");
+
+   const double mib = bench->raw / (1024.0 * 1024.0);
+   printf("frames: %llu (%.1f MiB of rgb)\n", (unsigned long long)bench->frames, mib);
+   printf("ratio: %.2f:1 (%.1f%% of raw)\n", (double)bench->raw / bench->packed, 100.0 * bench->packed / bench->raw);
+   printf("encode: %.1f MiB/s per core (%.2f ms per frame)\n", mib / bench->encode, 1e3 * bench->encode / bench->frames);
+   printf("decode: %.1f MiB/s per core (%.2f ms per frame)\n", mib / bench->decode, 1e3 * bench->decode / bench->frames);
+}
+
+// Buffers for the current video, set up again whenever the stream gets reconfigured
+struct state {
+   struct frame frame;
+   uint8_t *packed, *check;
+   bool benchmark;
+};
+
+static void
+setup(const struct video *video, struct state *state)
+{
+   const uint64_t frame_size = (uint64_t)video->width * video->height * 3;
+   state->frame.have = 0;
+
+   if (video->stream < 0 || !(video->compressed || state->benchmark))
+      return;
+
+   if (!(state->frame.data = realloc(state->frame.data, frame_size)))
+      err(EXIT_FAILURE, "realloc");
+
+   if (state->benchmark && (!(state->packed = realloc(state->packed, rawstripe_bound(video->width, video->height))) ||
+                            !(state->check = realloc(state->check, frame_size))))
+      err(EXIT_FAILURE, "realloc");
+}
+
+int
+main(int argc, char *argv[])
+{
+   struct state state = { .benchmark = (argc > 1 && !strcmp(argv[1], "-b")) };
+
+   if (argc > 1 && !state.benchmark) {
+      fprintf(stderr, "usage: %s [-b] < in.rawmux > out.rawmux\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   uint8_t header[255];
+   struct video video;
+   const size_t header_size = read_header(header, &video, stdin);
+
+   if (!state.benchmark)
+      write_all(header, header_size);
+
+   setup(&video, &state);
+
+   struct bench bench = {0};
+   uint8_t *data = NULL;
+   size_t allocated = 0;
+
+   for (uint8_t packet[13]; read_all(packet, sizeof(packet), stdin);) {
+      uint32_t size;
+      uint64_t pts;
+      memcpy(&size, packet + 1, sizeof(size));
+      memcpy(&pts, packet + 1 + 4, sizeof(pts));
+
+      if (allocated < size && !(data = realloc(data, (allocated = size))))
+         err(EXIT_FAILURE, "realloc");
+
+      if (!read_all(data, size, stdin))
+         break;
+
+      if (packet[0] == RAWMUX_RECONFIGURE) {
+         FILE *in;
+         if (!(in = fmemopen(data, size, "rb")))
+            err(EXIT_FAILURE, "fmemopen");
+
+         const size_t header_size = read_header(header, &video, in);
+         fclose(in);
+         setup(&video, &state);
+
+         if (!state.benchmark) {
+            memcpy(packet + 1, (uint32_t[]){header_size}, sizeof(uint32_t));
+            write_all(packet, sizeof(packet));
+            write_all(header, header_size);
+         }
+         continue;
+      }
+
+      if (packet[0] != video.stream) {
+         if (!state.benchmark) {
+            write_all(packet, sizeof(packet));
+            write_all(data, size);
+         }
+         continue;
+      }
+
+      const uint8_t *rgb = data;
+      if (video.compressed) {
+         if (!decode_stripe(&video, &state.frame, pts, data, size))
+            continue;
+         rgb = state.frame.data;
+      } else if (size != (uint64_t)video.width * video.height * 3) {
+         continue; // not rgb, nothing we can do with it
+      }
+
+      if (state.benchmark) {
+         bench_frame(&video, rgb, state.packed, state.check, &bench);
+      } else if (video.compressed) {
+         write_frame(&video, &state.frame);
+      } else {
+         write_all(packet, sizeof(packet));
+         write_all(data, size);
+      }
+   }
+
+   if (state.benchmark)
+      report(&bench);
+
+   fflush(stdout);
+   return EXIT_SUCCESS;
+}
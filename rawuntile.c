@@ -0,0 +1,291 @@
+/* gcc -std=c99 -O2 rawuntile.c -o rawuntile
+ *
+ * Reference reconstructor for glcapture's delta video (DELTA_FRAMES, see rawtile.h)
+ * Turns the rawmux stream back to plain rgb video, so ffmpeg's rawmux demuxer can read it
+ * Usage: ./rawuntile < /tmp/glcapture.fifo | ./ffplay -
+ *
+ * With -t it instead runs the video frames of a capture (delta or not) through the encoder and back,
+ * checks that every frame comes out bit-exact, and reports the savings
+ * Usage: ./rawuntile -t < capture.rawmux
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "rawtile.h"
+
+// Same as glcapture's DELTA_TILE
+#define TILE 64
+
+struct video {
+   int stream; // packet stream id, -1 if there's no video
+   uint32_t width, height;
+   bool delta;
+};
+
+struct test {
+   uint64_t frames, kinds[3], raw, packed;
+   double encode; // cpu seconds
+   bool key; // next frame has to be a key frame, e.g. the video got reconfigured
+};
+
+// Packet with a new rawmux header as payload, packets after it follow the new header (glcapture's RECONFIGURE_PACKETS)
+#define RAWMUX_RECONFIGURE 0xff
+
+static bool
+read_all(void *data, const size_t size, FILE *in)
+{
+   return fread(data, 1, size, in) == size;
+}
+
+static void
+write_all(const void *data, const size_t size)
+{
+   if (fwrite(data, 1, size, stdout) != size)
+      err(EXIT_FAILURE, "write");
+}
+
+static double
+cpu_time(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+read_string(uint8_t *out, const size_t max, FILE *in)
+{
+   size_t i = 0;
+   for (int c; i < max && (c = fgetc(in)) != EOF;) {
+      out[i++] = c;
+      if (!c)
+         return i;
+   }
+   errx(EXIT_FAILURE, "bad rawmux header");
+}
+
+static size_t
+read_header(uint8_t header[255], struct video *video, FILE *in)
+{
+   // Same header out, just with the plain video format
+   if (!read_all(header, 7, in) || memcmp(header, "rawmux", 6) || header[6] != 1)
+      errx(EXIT_FAILURE, "not a rawmux stream");
+
+   size_t size = 7;
+   *video = (struct video){ .stream = -1 };
+
+   for (int stream = 0;; ++stream) {
+      uint8_t type;
+      if (!read_all(&type, 1, in))
+         errx(EXIT_FAILURE, "bad rawmux header");
+
+      header[size++] = type;
+
+      if (!type)
+         return size;
+
+      uint8_t format[64];
+      const size_t len = read_string(format, sizeof(format), in);
+
+      if (type == 1) {
+         uint32_t fields[4];
+         if (!read_all(fields, sizeof(fields), in))
+            errx(EXIT_FAILURE, "bad rawmux header");
+
+         video->stream = stream;
+         video->width = fields[2];
+         video->height = fields[3];
+         video->delta = !strcmp((char*)format, RAWTILE_FORMAT);
+
+         const char *plain = (video->delta ? "rgb" : (char*)format);
+         memcpy(header + size, plain, strlen(plain) + 1); size += strlen(plain) + 1;
+         memcpy(header + size, fields, sizeof(fields)); size += sizeof(fields);
+      } else if (type == 2) {
+         memcpy(header + size, format, len); size += len;
+         if (!read_all(header + size, 5, in))
+            errx(EXIT_FAILURE, "bad rawmux header");
+         size += 5;
+      } else {
+         errx(EXIT_FAILURE, "unknown rawmux stream type %u", type);
+      }
+
+      if (size + 64 > 255)
+         errx(EXIT_FAILURE, "bad rawmux header");
+   }
+}
+
+static void
+write_frame(const struct video *video, const uint64_t pts, const uint8_t *frame)
+{
+   const uint32_t size = video->width * video->height * 3;
+   uint8_t packet[13] = { video->stream };
+   memcpy(packet + 1, &size, sizeof(size));
+   memcpy(packet + 1 + 4, &pts, sizeof(pts));
+   write_all(packet, sizeof(packet));
+   write_all(frame, size);
+}
+
+static void
+test_frame(const struct video *video, const uint8_t *rgb, uint64_t *hash, uint8_t *packed, uint8_t *check, struct test *test)
+{
+   const uint64_t frame_size = (uint64_t)video->width * video->height * 3;
+
+   const bool key = (!test->frames || test->key);
+   test->key = false;
+
+   const double start = cpu_time();
+   const uint64_t size = rawtile_encode(packed, rgb, video->width, video->height, TILE, hash, key);
+   test->encode += cpu_time() - start;
+
+   if (!rawtile_decode(check, packed, size, video->width, video->height, !key))
+      errx(EXIT_FAILURE, "test: failed to decode what was encoded (frame %llu)", (unsigned long long)test->frames);
+
+   if (memcmp(rgb, check, frame_size))
+      errx(EXIT_FAILURE, "test: frame %llu is not bit-exact", (unsigned long long)test->frames);
+
+   test->kinds[packed[0]]++;
+   test->frames++;
+   test->raw += frame_size;
+   test->packed += size;
+}
+
+static void
+report(const struct test *test)
+{
+   if (!test->frames)
+      errx(EXIT_FAILURE, "no rgb video frames to test");
+
+   const double mib = test->raw / (1024.0 * 1024.0);
+   printf("frames: %llu bit-exact (%.1f MiB of rgb)\n", (unsigned long long)test->frames, mib);
+   printf("packets: %llu key, %llu delta, %llu repeat\n",
+         (unsigned long long)test->kinds[RAWTILE_KEY], (unsigned long long)test->kinds[RAWTILE_DELTA], (unsigned long long)test->kinds[RAWTILE_REPEAT]);
+   printf("size: %.1f%% of raw (%.1f MiB)\n", 100.0 * test->packed / test->raw, test->packed / (1024.0 * 1024.0));
+   printf("encode: %.1f MiB/s per core (%.2f ms per frame)\n", mib / test->encode, 1e3 * test->encode / test->frames);
+}
+
+// Buffers for the current video, set up again whenever the stream gets reconfigured
+struct state {
+   uint8_t *frame, *packed, *check;
+   uint64_t *hash;
+   bool testing, have_key;
+};
+
+static void
+setup(const struct video *video, struct state *state)
+{
+   const uint64_t frame_size = (uint64_t)video->width * video->height * 3;
+   state->have_key = false;
+
+   if (video->stream < 0 || !(video->delta || state->testing))
+      return;
+
+   if (video->width > RAWTILE_MAX_COLUMNS * TILE)
+      errx(EXIT_FAILURE, "video is too wide");
+
+   if (!(state->frame = realloc(state->frame, frame_size)))
+      err(EXIT_FAILURE, "realloc");
+
+   if (!state->testing)
+      return;
+
+   // Every test starts from a key frame, so the hashes only need to be there
+   free(state->hash);
+   if (!(state->packed = realloc(state->packed, rawtile_bound(video->width, video->height, TILE))) ||
+       !(state->check = realloc(state->check, frame_size)) ||
+       !(state->hash = calloc(rawtile_count(video->width, video->height, TILE), sizeof(*state->hash))))
+      err(EXIT_FAILURE, "realloc");
+}
+
+int
+main(int argc, char *argv[])
+{
+   struct state state = { .testing = (argc > 1 && !strcmp(argv[1], "-t")) };
+
+   if (argc > 1 && !state.testing) {
+      fprintf(stderr, "usage: %s [-t] < in.rawmux > out.rawmux\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   uint8_t header[255];
+   struct video video;
+   const size_t header_size = read_header(header, &video, stdin);
+
+   if (!state.testing)
+      write_all(header, header_size);
+
+   setup(&video, &state);
+
+   struct test test = {0};
+   uint8_t *data = NULL;
+   size_t allocated = 0;
+
+   for (uint8_t packet[13]; read_all(packet, sizeof(packet), stdin);) {
+      uint32_t size;
+      uint64_t pts;
+      memcpy(&size, packet + 1, sizeof(size));
+      memcpy(&pts, packet + 1 + 4, sizeof(pts));
+
+      if (allocated < size && !(data = realloc(data, (allocated = size))))
+         err(EXIT_FAILURE, "realloc");
+
+      if (!read_all(data, size, stdin))
+         break;
+
+      if (packet[0] == RAWMUX_RECONFIGURE) {
+         FILE *in;
+         if (!(in = fmemopen(data, size, "rb")))
+            err(EXIT_FAILURE, "fmemopen");
+
+         const size_t header_size = read_header(header, &video, in);
+         fclose(in);
+         setup(&video, &state);
+         test.key = true;
+
+         if (!state.testing) {
+            memcpy(packet + 1, (uint32_t[]){header_size}, sizeof(uint32_t));
+            write_all(packet, sizeof(packet));
+            write_all(header, header_size);
+         }
+         continue;
+      }
+
+      if (packet[0] != video.stream) {
+         if (!state.testing) {
+            write_all(packet, sizeof(packet));
+            write_all(data, size);
+         }
+         continue;
+      }
+
+      const uint8_t *rgb = data;
+      if (video.delta) {
+         if (!rawtile_decode(state.frame, data, size, video.width, video.height, state.have_key))
+            errx(EXIT_FAILURE, "bad delta packet (pts %llu)", (unsigned long long)pts);
+         state.have_key = true;
+         rgb = state.frame;
+      } else if (size != (uint64_t)video.width * video.height * 3) {
+         continue; // not rgb, nothing we can do with it
+      }
+
+      if (state.testing) {
+         test_frame(&video, rgb, state.hash, state.packed, state.check, &test);
+      } else if (video.delta) {
+         write_frame(&video, pts, state.frame);
+      } else {
+         write_all(packet, sizeof(packet));
+         write_all(data, size);
+      }
+   }
+
+   if (state.testing)
+      report(&test);
+
+   fflush(stdout);
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+// Interleaving kernels for capturing non-interleaved (snd_pcm_writen) audio.
+// Kernels only move bits around, so one kernel serves every format with the same sample size (e.g. f32 and s32).
+// SSE2 is the x86_64 baseline, so no runtime dispatch is needed, others get the scalar loop.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define SAMPLES_SSE2 1
+#endif
+
+// Channels that are NULL get the silence pattern
+static void
+interleave_scalar(uint8_t *restrict dst, void *const *restrict src, const uint32_t channels, const size_t frames, const size_t offset, const uint8_t sample_bytes, const uint64_t silence)
+{
+   const size_t stride = (size_t)channels * sample_bytes;
+
+   for (uint32_t c = 0; c < channels; ++c) {
+      uint8_t *d = dst + (size_t)c * sample_bytes;
+
+      if (!src[c]) {
+         for (size_t f = offset; f < frames; ++f, d += stride)
+            memcpy(d, &silence, sample_bytes);
+         continue;
+      }
+
+      const uint8_t *s = (const uint8_t*)src[c] + offset * sample_bytes;
+      switch (sample_bytes) {
+         case 2:
+            for (size_t f = offset; f < frames; ++f, d += stride, s += 2)
+               memcpy(d, s, 2);
+            break;
+         case 4:
+            for (size_t f = offset; f < frames; ++f, d += stride, s += 4)
+               memcpy(d, s, 4);
+            break;
+         default:
+            for (size_t f = offset; f < frames; ++f, d += stride, s += sample_bytes)
+               memcpy(d, s, sample_bytes);
+            break;
+      }
+   }
+}
+
+#if SAMPLES_SSE2
+// Each kernel converts blocks of frames and returns how many frames it did, scalar loop does the rest
+
+static size_t
+interleave_s16_2ch(uint8_t *restrict dst, void *const *restrict src, const size_t frames)
+{
+   const uint8_t *l = src[0], *r = src[1];
+   size_t f = 0;
+   for (; f + 8 <= frames; f += 8, dst += 32) {
+      const __m128i a = _mm_loadu_si128((const __m128i*)(l + f * 2));
+      const __m128i b = _mm_loadu_si128((const __m128i*)(r + f * 2));
+      _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(a, b));
+      _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(a, b));
+   }
+   return f;
+}
+
+static size_t
+interleave_s32_2ch(uint8_t *restrict dst, void *const *restrict src, const size_t frames)
+{
+   const uint8_t *l = src[0], *r = src[1];
+   size_t f = 0;
+   for (; f + 4 <= frames; f += 4, dst += 32) {
+      const __m128i a = _mm_loadu_si128((const __m128i*)(l + f * 4));
+      const __m128i b = _mm_loadu_si128((const __m128i*)(r + f * 4));
+      _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi32(a, b));
+      _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi32(a, b));
+   }
+   return f;
+}
+
+// Transposes 4 frames of 4 channels, out[i] is frame i
+static inline void
+transpose_s32_4x4(const __m128i in[4], __m128i out[4])
+{
+   const __m128i t0 = _mm_unpacklo_epi32(in[0], in[1]), t1 = _mm_unpackhi_epi32(in[0], in[1]);
+   const __m128i t2 = _mm_unpacklo_epi32(in[2], in[3]), t3 = _mm_unpackhi_epi32(in[2], in[3]);
+   out[0] = _mm_unpacklo_epi64(t0, t2), out[1] = _mm_unpackhi_epi64(t0, t2);
+   out[2] = _mm_unpacklo_epi64(t1, t3), out[3] = _mm_unpackhi_epi64(t1, t3);
+}
+
+static size_t
+interleave_s32_6ch(uint8_t *restrict dst, void *const *restrict src, const size_t frames)
+{
+   size_t f = 0;
+   for (; f + 4 <= frames; f += 4, dst += 96) {
+      __m128i in[4], lo[4];
+      for (int c = 0; c < 4; ++c)
+         in[c] = _mm_loadu_si128((const __m128i*)((const uint8_t*)src[c] + f * 4));
+
+      transpose_s32_4x4(in, lo);
+      const __m128i c4 = _mm_loadu_si128((const __m128i*)((const uint8_t*)src[4] + f * 4));
+      const __m128i c5 = _mm_loadu_si128((const __m128i*)((const uint8_t*)src[5] + f * 4));
+      const __m128i hi[2] = { _mm_unpacklo_epi32(c4, c5), _mm_unpackhi_epi32(c4, c5) };
+
+      for (int i = 0; i < 4; ++i) {
+         _mm_storeu_si128((__m128i*)(dst + i * 24), lo[i]);
+         _mm_storel_epi64((__m128i*)(dst + i * 24 + 16), (i & 1 ? _mm_unpackhi_epi64(hi[i / 2], hi[i / 2]) : hi[i / 2]));
+      }
+   }
+   return f;
+}
+
+static size_t
+interleave_s32_8ch(uint8_t *restrict dst, void *const *restrict src, const size_t frames)
+{
+   size_t f = 0;
+   for (; f + 4 <= frames; f += 4, dst += 128) {
+      __m128i in[8], lo[4], hi[4];
+      for (int c = 0; c < 8; ++c)
+         in[c] = _mm_loadu_si128((const __m128i*)((const uint8_t*)src[c] + f * 4));
+
+      transpose_s32_4x4(in, lo);
+      transpose_s32_4x4(in + 4, hi);
+
+      for (int i = 0; i < 4; ++i) {
+         _mm_storeu_si128((__m128i*)(dst + i * 32), lo[i]);
+         _mm_storeu_si128((__m128i*)(dst + i * 32 + 16), hi[i]);
+      }
+   }
+   return f;
+}
+
+// Transposes 8 frames of 8 channels, out[i] is frame i
+static inline void
+transpose_s16_8x8(const __m128i in[8], __m128i out[8])
+{
+   const __m128i a0 = _mm_unpacklo_epi16(in[0], in[1]), a1 = _mm_unpackhi_epi16(in[0], in[1]);
+   const __m128i a2 = _mm_unpacklo_epi16(in[2], in[3]), a3 = _mm_unpackhi_epi16(in[2], in[3]);
+   const __m128i a4 = _mm_unpacklo_epi16(in[4], in[5]), a5 = _mm_unpackhi_epi16(in[4], in[5]);
+   const __m128i a6 = _mm_unpacklo_epi16(in[6], in[7]), a7 = _mm_unpackhi_epi16(in[6], in[7]);
+   const __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+   const __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+   const __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+   const __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+   out[0] = _mm_unpacklo_epi64(b0, b4), out[1] = _mm_unpackhi_epi64(b0, b4);
+   out[2] = _mm_unpacklo_epi64(b1, b5), out[3] = _mm_unpackhi_epi64(b1, b5);
+   out[4] = _mm_unpacklo_epi64(b2, b6), out[5] = _mm_unpackhi_epi64(b2, b6);
+   out[6] = _mm_unpacklo_epi64(b3, b7), out[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static size_t
+interleave_s16_6ch(uint8_t *restrict dst, void *const *restrict src, const size_t frames)
+{
+   size_t f = 0;
+   for (; f + 8 <= frames; f += 8, dst += 96) {
+      __m128i in[8], out[8];
+      for (int c = 0; c < 6; ++c)
+         in[c] = _mm_loadu_si128((const __m128i*)((const uint8_t*)src[c] + f * 2));
+
+      in[6] = in[7] = _mm_setzero_si128();
+      transpose_s16_8x8(in, out);
+
+      // 12 bytes per frame, as 8 + 4
+      for (int i = 0; i < 8; ++i) {
+         _mm_storel_epi64((__m128i*)(dst + i * 12), out[i]);
+         const int32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(out[i], 8));
+         memcpy(dst + i * 12 + 8, &tail, sizeof(tail));
+      }
+   }
+   return f;
+}
+
+static size_t
+interleave_s16_8ch(uint8_t *restrict dst, void *const *restrict src, const size_t frames)
+{
+   size_t f = 0;
+   for (; f + 8 <= frames; f += 8, dst += 128) {
+      __m128i in[8], out[8];
+      for (int c = 0; c < 8; ++c)
+         in[c] = _mm_loadu_si128((const __m128i*)((const uint8_t*)src[c] + f * 2));
+
+      transpose_s16_8x8(in, out);
+
+      for (int i = 0; i < 8; ++i)
+         _mm_storeu_si128((__m128i*)(dst + i * 16), out[i]);
+   }
+   return f;
+}
+#endif
+
+// Interleaves per channel buffers of frames samples into dst, e.g. f32, s32 and s16 in 2, 6 and 8 channels take the fast path
+static void
+interleave_samples(uint8_t *restrict dst, void *const *restrict src, const uint32_t channels, const size_t frames, const uint8_t sample_bytes, const uint64_t silence)
+{
+   size_t done = 0;
+
+#if SAMPLES_SSE2
+   bool silent = false;
+   for (uint32_t c = 0; c < channels; ++c)
+      silent |= !src[c];
+
+   if (!silent) {
+      if (sample_bytes == 2) {
+         switch (channels) {
+            case 2: done = interleave_s16_2ch(dst, src, frames); break;
+            case 6: done = interleave_s16_6ch(dst, src, frames); break;
+            case 8: done = interleave_s16_8ch(dst, src, frames); break;
+         }
+      } else if (sample_bytes == 4) {
+         switch (channels) {
+            case 2: done = interleave_s32_2ch(dst, src, frames); break;
+            case 6: done = interleave_s32_6ch(dst, src, frames); break;
+            case 8: done = interleave_s32_8ch(dst, src, frames); break;
+         }
+      }
+   }
+#endif
+
+   interleave_scalar(dst + done * channels * sample_bytes, src, channels, frames, done, sample_bytes, silence);
+}
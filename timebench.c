@@ -0,0 +1,137 @@
+/* gcc -std=c99 -O2 timebench.c -o timebench
+ *
+ * Microbenchmark of what glcapture's time hooks add to every call the game makes
+ * Times clock_gettime, gettimeofday and time as the program sees them against libc's own (vDSO backed) ones
+ * Usage: LD_PRELOAD=./glcapture.so ./timebench [calls]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <err.h>
+#include <sys/time.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+enum call {
+   CALL_MONOTONIC,
+   CALL_MONOTONIC_RAW,
+   CALL_REALTIME,
+   CALL_THREAD_CPUTIME,
+   CALL_GETTIMEOFDAY,
+   CALL_TIME,
+};
+
+static const char *NAMES[] = {
+   [CALL_MONOTONIC] = "clock_gettime(CLOCK_MONOTONIC)",
+   [CALL_MONOTONIC_RAW] = "clock_gettime(CLOCK_MONOTONIC_RAW)",
+   [CALL_REALTIME] = "clock_gettime(CLOCK_REALTIME)",
+   [CALL_THREAD_CPUTIME] = "clock_gettime(CLOCK_THREAD_CPUTIME_ID)",
+   [CALL_GETTIMEOFDAY] = "gettimeofday",
+   [CALL_TIME] = "time",
+};
+
+struct fns {
+   int (*clock_gettime)(clockid_t, struct timespec*);
+   int (*gettimeofday)(struct timeval*, void*);
+   time_t (*time)(time_t*);
+};
+
+// dlsym would give us the hooks back when glcapture is preloaded, dlvsym on libc itself doesn't
+static void*
+libc_symbol(const char *name)
+{
+   void *libc;
+   if (!(libc = dlopen("libc.so.6", RTLD_LAZY | RTLD_NOLOAD)))
+      return NULL;
+
+   void *ptr = NULL;
+   const char *versions[] = { "GLIBC_2.17", "GLIBC_2.2.5", "GLIBC_2.0" };
+   for (size_t i = 0; !ptr && i < ARRAY_SIZE(versions); ++i)
+      ptr = dlvsym(libc, name, versions[i]);
+   return ptr;
+}
+
+static uint64_t
+now_ns(const struct fns *libc)
+{
+   struct timespec ts;
+   libc->clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Results are summed, so the compiler can't drop the calls
+static uint64_t
+run(const struct fns *fns, const enum call call, const uint64_t calls)
+{
+   uint64_t sum = 0;
+   struct timespec ts;
+   struct timeval tv;
+
+   for (uint64_t i = 0; i < calls; ++i) {
+      switch (call) {
+         case CALL_MONOTONIC: fns->clock_gettime(CLOCK_MONOTONIC, &ts); sum += ts.tv_nsec; break;
+         case CALL_MONOTONIC_RAW: fns->clock_gettime(CLOCK_MONOTONIC_RAW, &ts); sum += ts.tv_nsec; break;
+         case CALL_REALTIME: fns->clock_gettime(CLOCK_REALTIME, &ts); sum += ts.tv_nsec; break;
+         case CALL_THREAD_CPUTIME: fns->clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts); sum += ts.tv_nsec; break;
+         case CALL_GETTIMEOFDAY: fns->gettimeofday(&tv, NULL); sum += tv.tv_usec; break;
+         case CALL_TIME: sum += fns->time(NULL); break;
+      }
+   }
+
+   return sum;
+}
+
+// Best of a few rounds, ns per call, rounds alternate between the two so both see the same conditions
+static void
+measure(const struct fns *hooked, const struct fns *libc, const enum call call, const uint64_t calls, double best[2], uint64_t *sink)
+{
+   for (int round = 0; round < 5; ++round) {
+      for (int i = 0; i < 2; ++i) {
+         const uint64_t start = now_ns(libc);
+         *sink += run((i ? libc : hooked), call, calls);
+         const double ns = (double)(now_ns(libc) - start) / calls;
+         best[i] = (!round || ns < best[i] ? ns : best[i]);
+      }
+   }
+}
+
+int
+main(int argc, char *argv[])
+{
+   const uint64_t calls = (argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000);
+
+   if (argc > 2 || !calls) {
+      fprintf(stderr, "usage: %s [calls]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   const struct fns hooked = {
+      .clock_gettime = clock_gettime,
+      .gettimeofday = gettimeofday,
+      .time = time,
+   };
+
+   const struct fns libc = {
+      .clock_gettime = libc_symbol("clock_gettime"),
+      .gettimeofday = libc_symbol("gettimeofday"),
+      .time = libc_symbol("time"),
+   };
+
+   if (!libc.clock_gettime || !libc.gettimeofday || !libc.time)
+      errx(EXIT_FAILURE, "can't find libc's time functions");
+
+   printf("%-40s %10s %10s %10s\n", "call", "hooked", "libc", "overhead");
+
+   uint64_t sink = 0;
+   for (size_t i = 0; i < ARRAY_SIZE(NAMES); ++i) {
+      double best[2];
+      measure(&hooked, &libc, i, calls, best, &sink);
+      printf("%-40s %8.1fns %8.1fns %8.1fns\n", NAMES[i], best[0], best[1], best[0] - best[1]);
+   }
+
+   return (sink == 42 ? EXIT_FAILURE : EXIT_SUCCESS);
+}